@@ -0,0 +1,355 @@
+#include "capture.h"
+
+#include <SDL2/SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_CAPTURE_PATH 256
+
+static unsigned char *
+CaptureAcquireFrame(capture *Capture)
+{
+    unsigned char *Pixels = 0;
+
+    SDL_LockMutex(Capture->Lock);
+    if (Capture->FreeCount)
+        Pixels = Capture->FreeFrames[--Capture->FreeCount];
+    SDL_UnlockMutex(Capture->Lock);
+
+    if (!Pixels)
+        Pixels = (unsigned char *) malloc(Capture->FrameSize);
+
+    return Pixels;
+}
+
+static void
+CaptureReleaseFrame(capture *Capture, unsigned char *Pixels)
+{
+    SDL_LockMutex(Capture->Lock);
+    if (Capture->FreeCount < CAPTURE_QUEUE_LENGTH + 2) {
+        Capture->FreeFrames[Capture->FreeCount++] = Pixels;
+        Pixels = 0;
+    }
+    SDL_UnlockMutex(Capture->Lock);
+
+    free(Pixels);
+}
+
+// Blocks only when the writer has fallen CAPTURE_QUEUE_LENGTH frames behind,
+// since dropping frames would ruin the recording.
+static void
+CaptureQueuePush(capture *Capture, capture_frame Frame)
+{
+    SDL_LockMutex(Capture->Lock);
+    while (Capture->QueueCount == CAPTURE_QUEUE_LENGTH)
+        SDL_CondWait(Capture->QueueChanged, Capture->Lock);
+    int Tail = (Capture->QueueHead + Capture->QueueCount) % CAPTURE_QUEUE_LENGTH;
+    Capture->Queue[Tail] = Frame;
+    Capture->QueueCount++;
+    SDL_CondBroadcast(Capture->QueueChanged);
+    SDL_UnlockMutex(Capture->Lock);
+}
+
+static bool
+CaptureWriteRows(capture *Capture, FILE *File, unsigned char *Pixels, unsigned char *Row)
+{
+    // GL rows start at the bottom, and the alpha channel is dropped.
+    for (int Y = Capture->Height - 1; Y >= 0; --Y) {
+        unsigned char *Source = Pixels + 4 * Capture->Width * Y;
+        unsigned char *Dest = Row;
+        for (int X = 0; X < Capture->Width; ++X) {
+            *Dest++ = *Source++;
+            *Dest++ = *Source++;
+            *Dest++ = *Source++;
+            Source++;
+        }
+        if (fwrite(Row, 3, Capture->Width, File) != (size_t) Capture->Width)
+            return false;
+    }
+
+    return true;
+}
+
+static bool
+CaptureWriteFrame(capture *Capture, capture_frame Frame, unsigned char *Row)
+{
+    if (Capture->Format == CAPTURE_RAW_VIDEO) {
+        if (!CaptureWriteRows(Capture, Capture->RawFile, Frame.Pixels, Row)) {
+            fprintf(stderr, "Failed to write frame %d to %s\n", Frame.Number, Capture->Path);
+            return false;
+        }
+    } else {
+        char Path[MAX_CAPTURE_PATH];
+        snprintf(Path, sizeof(Path), "%s%05d.ppm", Capture->Path, Frame.Number);
+        FILE *File = fopen(Path, "wb");
+        if (!File) {
+            fprintf(stderr, "Failed to open %s for writing\n", Path);
+            return false;
+        }
+        bool Written = fprintf(File, "P6\n%d %d\n255\n", Capture->Width, Capture->Height) > 0
+            && CaptureWriteRows(Capture, File, Frame.Pixels, Row);
+        // Buffered data only hits the disk here, so a full disk may only
+        // show up now
+        Written = !fclose(File) && Written;
+        if (!Written) {
+            fprintf(stderr, "Failed to write %s\n", Path);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int
+CaptureWriterMain(void *Data)
+{
+    capture *Capture = (capture *) Data;
+    unsigned char *Row = (unsigned char *) malloc(3 * Capture->Width);
+
+    for (;;) {
+        SDL_LockMutex(Capture->Lock);
+        while (!Capture->QueueCount && !Capture->Finished)
+            SDL_CondWait(Capture->QueueChanged, Capture->Lock);
+        if (!Capture->QueueCount) {
+            SDL_UnlockMutex(Capture->Lock);
+            break;
+        }
+        capture_frame Frame = Capture->Queue[Capture->QueueHead];
+        Capture->QueueHead = (Capture->QueueHead + 1) % CAPTURE_QUEUE_LENGTH;
+        Capture->QueueCount--;
+        bool Failed = Capture->Failed;
+        SDL_CondBroadcast(Capture->QueueChanged);
+        SDL_UnlockMutex(Capture->Lock);
+
+        // Frames after a failed one would leave a gap in the sequence or
+        // a torn raw stream, so they are dropped.
+        if (!Failed) {
+            if (CaptureWriteFrame(Capture, Frame, Row)) {
+                Capture->WrittenCount++;
+            } else {
+                SDL_LockMutex(Capture->Lock);
+                Capture->Failed = true;
+                SDL_UnlockMutex(Capture->Lock);
+            }
+        }
+        CaptureReleaseFrame(Capture, Frame.Pixels);
+    }
+
+    free(Row);
+    return 0;
+}
+
+// Copies the oldest pending readback to the writer once its fence has
+// signaled. Returns false if the GPU isn't done within Timeout.
+static bool
+CaptureCollectOldest(capture *Capture, GLuint64 Timeout)
+{
+    int Slot = (Capture->NextSlot + CAPTURE_BUFFER_COUNT - Capture->PendingCount)
+        % CAPTURE_BUFFER_COUNT;
+
+    GLenum Status = glClientWaitSync(
+            Capture->Fences[Slot],
+            GL_SYNC_FLUSH_COMMANDS_BIT,
+            Timeout);
+    if (Status == GL_TIMEOUT_EXPIRED)
+        return false;
+    if (Status == GL_WAIT_FAILED)
+        fprintf(stderr, "Waiting for capture fence failed\n");
+
+    glDeleteSync(Capture->Fences[Slot]);
+    Capture->Fences[Slot] = 0;
+    Capture->PendingCount--;
+
+    capture_frame Frame;
+    Frame.Number = Capture->FrameNumbers[Slot];
+    Frame.Pixels = CaptureAcquireFrame(Capture);
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, Capture->PixelBuffers[Slot]);
+    void *Mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, Capture->FrameSize, GL_MAP_READ_BIT);
+    if (Mapped) {
+        memcpy(Frame.Pixels, Mapped, Capture->FrameSize);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        CaptureQueuePush(Capture, Frame);
+    } else {
+        fprintf(stderr, "Failed to map capture buffer, dropping frame %d\n", Frame.Number);
+        CaptureReleaseFrame(Capture, Frame.Pixels);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    return true;
+}
+
+bool
+CaptureCreate(
+        capture *Capture,
+        int Width,
+        int Height,
+        int Samples,
+        capture_format Format,
+        const char *Path)
+{
+    memset(Capture, 0, sizeof(*Capture));
+    Capture->Width = Width;
+    Capture->Height = Height;
+    Capture->FrameSize = 4 * Width * Height;
+    Capture->Format = Format;
+    Capture->Path = Path;
+
+    if (Format == CAPTURE_RAW_VIDEO) {
+        Capture->RawFile = fopen(Path, "wb");
+        if (!Capture->RawFile) {
+            fprintf(stderr, "Failed to open %s for writing\n", Path);
+            return false;
+        }
+    }
+
+    glGenRenderbuffers(1, &Capture->ColorBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, Capture->ColorBuffer);
+    glRenderbufferStorageMultisample(GL_RENDERBUFFER, Samples, GL_RGBA8, Width, Height);
+
+    glGenRenderbuffers(1, &Capture->DepthBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, Capture->DepthBuffer);
+    glRenderbufferStorageMultisample(GL_RENDERBUFFER, Samples, GL_DEPTH_COMPONENT24, Width, Height);
+
+    glGenFramebuffers(1, &Capture->Framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, Capture->Framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, Capture->ColorBuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, Capture->DepthBuffer);
+    bool Complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+
+    glGenRenderbuffers(1, &Capture->ResolveBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, Capture->ResolveBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, Width, Height);
+
+    glGenFramebuffers(1, &Capture->ResolveFramebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, Capture->ResolveFramebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, Capture->ResolveBuffer);
+    Complete = Complete && glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    if (!Complete) {
+        fprintf(stderr, "Capture framebuffer is incomplete\n");
+        return false;
+    }
+
+    glGenBuffers(CAPTURE_BUFFER_COUNT, Capture->PixelBuffers);
+    for (int i = 0; i < CAPTURE_BUFFER_COUNT; ++i) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, Capture->PixelBuffers[i]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, Capture->FrameSize, 0, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    Capture->Lock = SDL_CreateMutex();
+    Capture->QueueChanged = SDL_CreateCond();
+    Capture->Writer = SDL_CreateThread(CaptureWriterMain, "capture writer", Capture);
+    if (!Capture->Writer) {
+        fprintf(stderr, "Failed to start capture writer: %s\n", SDL_GetError());
+        return false;
+    }
+
+    return true;
+}
+
+void
+CaptureBegin(capture *Capture)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, Capture->Framebuffer);
+    glViewport(0, 0, Capture->Width, Capture->Height);
+}
+
+/* Returns false once the writer has failed, after which the capture
+ * should be stopped. */
+bool
+CaptureEnd(capture *Capture, int WindowWidth, int WindowHeight, bool Present)
+{
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, Capture->Framebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, Capture->ResolveFramebuffer);
+    glBlitFramebuffer(
+            0, 0, Capture->Width, Capture->Height,
+            0, 0, Capture->Width, Capture->Height,
+            GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+    // Only stall if every buffer is still in flight
+    if (Capture->PendingCount == CAPTURE_BUFFER_COUNT)
+        while (!CaptureCollectOldest(Capture, 1000000000));
+
+    int Slot = Capture->NextSlot;
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, Capture->ResolveFramebuffer);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, Capture->PixelBuffers[Slot]);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, Capture->Width, Capture->Height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    Capture->Fences[Slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    Capture->FrameNumbers[Slot] = Capture->FrameCount++;
+    Capture->NextSlot = (Slot + 1) % CAPTURE_BUFFER_COUNT;
+    Capture->PendingCount++;
+
+    // Pick up whatever earlier frames are done without waiting
+    while (Capture->PendingCount > 1 && CaptureCollectOldest(Capture, 0));
+
+    if (Present) {
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        glBlitFramebuffer(
+                0, 0, Capture->Width, Capture->Height,
+                0, 0, WindowWidth, WindowHeight,
+                GL_COLOR_BUFFER_BIT, GL_LINEAR);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, WindowWidth, WindowHeight);
+
+    SDL_LockMutex(Capture->Lock);
+    bool Failed = Capture->Failed;
+    SDL_UnlockMutex(Capture->Lock);
+
+    return !Failed;
+}
+
+// Returns false if any frame didn't make it to disk
+bool
+CaptureDestroy(capture *Capture)
+{
+    while (Capture->PendingCount)
+        CaptureCollectOldest(Capture, 1000000000);
+
+    if (Capture->Writer) {
+        SDL_LockMutex(Capture->Lock);
+        Capture->Finished = true;
+        SDL_CondBroadcast(Capture->QueueChanged);
+        SDL_UnlockMutex(Capture->Lock);
+        SDL_WaitThread(Capture->Writer, 0);
+    }
+
+    for (int i = 0; i < Capture->FreeCount; ++i)
+        free(Capture->FreeFrames[i]);
+
+    if (Capture->RawFile && fclose(Capture->RawFile) && !Capture->Failed) {
+        fprintf(stderr, "Failed to write %s\n", Capture->Path);
+        Capture->Failed = true;
+    }
+
+    if (Capture->Lock)
+        SDL_DestroyMutex(Capture->Lock);
+    if (Capture->QueueChanged)
+        SDL_DestroyCond(Capture->QueueChanged);
+
+    glDeleteBuffers(CAPTURE_BUFFER_COUNT, Capture->PixelBuffers);
+    glDeleteFramebuffers(1, &Capture->Framebuffer);
+    glDeleteFramebuffers(1, &Capture->ResolveFramebuffer);
+    glDeleteRenderbuffers(1, &Capture->ColorBuffer);
+    glDeleteRenderbuffers(1, &Capture->DepthBuffer);
+    glDeleteRenderbuffers(1, &Capture->ResolveBuffer);
+
+    if (Capture->Failed) {
+        fprintf(stderr, "Capture failed, %d of %d frames written\n",
+                Capture->WrittenCount,
+                Capture->FrameCount);
+        return false;
+    }
+
+    printf("Captured %d frames\n", Capture->FrameCount);
+    return true;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <SDL2/SDL_mutex.h>
+#include <SDL2/SDL_thread.h>
+#include <stdio.h>
+
+// Frames in flight between glReadPixels and the CPU. The oldest one is
+// only waited on when the GPU is this many frames behind.
+#define CAPTURE_BUFFER_COUNT 3
+// Frames handed to the writer thread but not yet on disk.
+#define CAPTURE_QUEUE_LENGTH 8
+
+enum capture_format {
+    CAPTURE_PPM_SEQUENCE,
+    CAPTURE_RAW_VIDEO,
+};
+
+struct capture_frame {
+    int Number;
+    unsigned char *Pixels;
+};
+
+struct capture {
+    int Width;
+    int Height;
+    int FrameSize;
+    capture_format Format;
+    const char *Path;
+    FILE *RawFile;
+
+    // Multisampled render target, resolved into a single sample one
+    // that is read back and presented.
+    GLuint Framebuffer;
+    GLuint ColorBuffer;
+    GLuint DepthBuffer;
+    GLuint ResolveFramebuffer;
+    GLuint ResolveBuffer;
+
+    GLuint PixelBuffers[CAPTURE_BUFFER_COUNT];
+    GLsync Fences[CAPTURE_BUFFER_COUNT];
+    int FrameNumbers[CAPTURE_BUFFER_COUNT];
+    int NextSlot;
+    int PendingCount;
+    int FrameCount;
+
+    SDL_Thread *Writer;
+    SDL_mutex *Lock;
+    SDL_cond *QueueChanged;
+    capture_frame Queue[CAPTURE_QUEUE_LENGTH];
+    int QueueHead;
+    int QueueCount;
+    unsigned char *FreeFrames[CAPTURE_QUEUE_LENGTH + 2];
+    int FreeCount;
+    bool Finished;
+    // Set by the writer on the first failed write, after which it only
+    // discards frames.
+    bool Failed;
+    int WrittenCount;
+};
+
+bool CaptureCreate(
+        capture *Capture,
+        int Width,
+        int Height,
+        int Samples,
+        capture_format Format,
+        const char *Path);
+void CaptureBegin(capture *Capture);
+bool CaptureEnd(capture *Capture, int WindowWidth, int WindowHeight, bool Present);
+bool CaptureDestroy(capture *Capture);
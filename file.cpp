@@ -4,9 +4,7 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define MAX_LINE 256
-
-static int GetLine(char *Buffer, FILE *File)
+int GetLine(char *Buffer, FILE *File)
 {
 	int Input;
 	int Len = 0;
@@ -18,7 +16,7 @@ static int GetLine(char *Buffer, FILE *File)
 	return Len - 1;
 }
 
-static int GetCsvFields(char *Fields[], char *Str, int MaxFields)
+int GetCsvFields(char *Fields[], char *Str, int MaxFields)
 {
 	for (int Field = 0; Field < MaxFields; ++Field) {
 		if (!Str)
@@ -50,11 +48,21 @@ static int GetCsvFields(char *Fields[], char *Str, int MaxFields)
 		return MaxFields;
 }
 
+static int FindBody(world *World, const char *Name)
+{
+	for (int Body = 0; Body < World->Count; ++Body)
+		if (!strncmp(World->Name[Body], Name, MAX_NAME))
+			return Body;
+	return NO_PARENT;
+}
+
 void ReadWorldFile(world *World, FILE *File)
 {
 	char Line[MAX_LINE];
 	const int NumFields = 12;
-	char *Fields[NumFields];
+	// Optional name of the parent, which must come earlier in the file
+	const int MaxFields = NumFields + 1;
+	char *Fields[MaxFields];
 	int Lineno = 0;
 	World->Count = 0;
 
@@ -63,12 +71,21 @@ void ReadWorldFile(world *World, FILE *File)
 		if (*Line == '#')
 			continue;
 
-		int GotFields = GetCsvFields(Fields, Line, NumFields);
-		if (GotFields != NumFields) {
-			printf("Line %d: expected %d fields, got %d\n", Lineno, NumFields, GotFields);
+		int GotFields = GetCsvFields(Fields, Line, MaxFields);
+		if (GotFields != NumFields && GotFields != MaxFields) {
+			printf("Line %d: expected %d or %d fields, got %d\n", Lineno, NumFields, MaxFields, GotFields);
 			continue;
 		}
 
+		World->Parent[World->Count] = NO_PARENT;
+		if (GotFields == MaxFields) {
+			World->Parent[World->Count] = FindBody(World, Fields[12]);
+			if (World->Parent[World->Count] == NO_PARENT) {
+				printf("Line %d: unknown parent %s\n", Lineno, Fields[12]);
+				continue;
+			}
+		}
+
 		strncpy(World->Name[World->Count], Fields[0], MAX_NAME);
 
 		sscanf(Fields[ 1], "%f", &World->Color[World->Count].x);
@@ -86,6 +103,8 @@ void ReadWorldFile(world *World, FILE *File)
 		sscanf(Fields[ 9], "%f", &World->Velocity[World->Count].x);
 		sscanf(Fields[10], "%f", &World->Velocity[World->Count].y);
 		sscanf(Fields[11], "%f", &World->Velocity[World->Count].z);
+		World->Id[World->Count] = World->Count;
+		World->IndexOfId[World->Count] = World->Count;
 		World->Count++;
 	}
 }
@@ -3,4 +3,8 @@
 #include "world.h"
 #include <stdio.h>
 
+#define MAX_LINE 256
+
+int GetLine(char *Buffer, FILE *File);
+int GetCsvFields(char *Fields[], char *Str, int MaxFields);
 void ReadWorldFile(world *World, FILE *File);
@@ -40,3 +40,87 @@ LineSphereIntersect(
     }
 }
 
+/* Tiles are numbered face-major, with the faces in the order +x, -x, +y,
+ * -y, +z, -z. The face coordinates are warped by atan so that the tiles
+ * are closer to equal area. */
+int
+CubeTileFromDirection(glm::vec3 Direction, int TileResolution)
+{
+    glm::vec3 Abs = glm::abs(Direction);
+    int Face;
+    float U, V;
+
+    if (Abs.x >= Abs.y && Abs.x >= Abs.z) {
+        Face = Direction.x > 0.0f ? 0 : 1;
+        U = Direction.y / Abs.x;
+        V = Direction.z / Abs.x;
+    } else if (Abs.y >= Abs.z) {
+        Face = Direction.y > 0.0f ? 2 : 3;
+        U = Direction.z / Abs.y;
+        V = Direction.x / Abs.y;
+    } else {
+        Face = Direction.z > 0.0f ? 4 : 5;
+        U = Direction.x / Abs.z;
+        V = Direction.y / Abs.z;
+    }
+
+    const float FourOverPi = 1.2732395f;
+    int TileU = (int) (0.5f * (FourOverPi * atanf(U) + 1.0f) * TileResolution);
+    int TileV = (int) (0.5f * (FourOverPi * atanf(V) + 1.0f) * TileResolution);
+    TileU = glm::clamp(TileU, 0, TileResolution - 1);
+    TileV = glm::clamp(TileV, 0, TileResolution - 1);
+
+    return (Face * TileResolution + TileV) * TileResolution + TileU;
+}
+
+/* Unit direction through the point (U, V) of a tile, where 0 and 1 are
+ * the tile edges. */
+glm::vec3
+CubeTileDirection(int Tile, int TileResolution, float U, float V)
+{
+    int Face = Tile / (TileResolution * TileResolution);
+    int TileV = Tile / TileResolution % TileResolution;
+    int TileU = Tile % TileResolution;
+
+    const float PiOverFour = 0.78539816f;
+    float FaceU = tanf(PiOverFour * (2.0f * (TileU + U) / TileResolution - 1.0f));
+    float FaceV = tanf(PiOverFour * (2.0f * (TileV + V) / TileResolution - 1.0f));
+    float Sign = (Face & 1) ? -1.0f : 1.0f;
+
+    glm::vec3 Direction;
+    switch (Face / 2) {
+        case 0:
+            Direction = glm::vec3(Sign, FaceU, FaceV);
+            break;
+        case 1:
+            Direction = glm::vec3(FaceV, Sign, FaceU);
+            break;
+        default:
+            Direction = glm::vec3(FaceU, FaceV, Sign);
+            break;
+    }
+
+    return glm::normalize(Direction);
+}
+
+/* Spreads the low 10 bits of Value out to every third bit. */
+static unsigned int
+MortonSpread(unsigned int Value)
+{
+    Value &= 0x3ff;
+    Value = (Value | (Value << 16)) & 0x030000ff;
+    Value = (Value | (Value <<  8)) & 0x0300f00f;
+    Value = (Value | (Value <<  4)) & 0x030c30c3;
+    Value = (Value | (Value <<  2)) & 0x09249249;
+    return Value;
+}
+
+/* 30 bit Z-order index of a point inside the unit cube. */
+unsigned int
+MortonCode(glm::vec3 Normalized)
+{
+    glm::vec3 Cell = glm::clamp(Normalized * 1024.0f, 0.0f, 1023.0f);
+    return (MortonSpread((unsigned int) Cell.x) << 2)
+        | (MortonSpread((unsigned int) Cell.y) << 1)
+        | MortonSpread((unsigned int) Cell.z);
+}
@@ -8,3 +8,6 @@ int LineSphereIntersect(
         float SphereRadius,
         glm::vec3 LineOrigin,
         glm::vec3 LineDirection);
+int CubeTileFromDirection(glm::vec3 Direction, int TileResolution);
+glm::vec3 CubeTileDirection(int Tile, int TileResolution, float U, float V);
+unsigned int MortonCode(glm::vec3 Normalized);
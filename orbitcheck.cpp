@@ -0,0 +1,122 @@
+/* Integrates a world file for a while at the viewer's step and checks
+ * that the semi-major axis of every moon stays put. The osculating axis
+ * wobbles a little under the pull of the other bodies, but a steady
+ * drift means the integration of the moons is off.
+ *
+ * Exits with 1 if any moon drifted more than the tolerance. */
+
+#include "file.h"
+#include "world.h"
+#include <glm/glm.hpp>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_WORLD "planets.csv"
+#define DEFAULT_DAYS 365
+#define DEFAULT_TOLERANCE 0.2f
+#define SECONDS_PER_DAY 86400.0f
+
+// km^3 / (kg s^2)
+#define G 6.674e-20
+
+static double
+SemiMajorAxis(world *World, int Body)
+{
+    int Parent = World->Parent[Body];
+    double Mu = G * (World->Mass[Parent] + World->Mass[Body]);
+    glm::dvec3 Position(World->Position[Body]);
+    glm::dvec3 Velocity(World->Velocity[Body]);
+    return 1.0 / (2.0 / glm::length(Position) - glm::dot(Velocity, Velocity) / Mu);
+}
+
+static void
+PrintUsage(const char *Program)
+{
+    fprintf(stderr,
+            "Usage: %s [-days N] [-step S] [-tolerance P] [world.csv]\n"
+            "  -days N        Simulated days (default %d)\n"
+            "  -step S        Seconds per step (default %g)\n"
+            "  -tolerance P   Largest drift allowed, in percent (default %g)\n",
+            Program,
+            DEFAULT_DAYS,
+            SIMULATION_STEP,
+            DEFAULT_TOLERANCE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *Path = DEFAULT_WORLD;
+    int Days = DEFAULT_DAYS;
+    float Step = SIMULATION_STEP;
+    float Tolerance = DEFAULT_TOLERANCE;
+    bool GotPath = false;
+
+    for (int i = 1; i < argc; ++i) {
+        bool HasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "-days") && HasValue) {
+            Days = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-step") && HasValue) {
+            Step = (float) atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-tolerance") && HasValue) {
+            Tolerance = (float) atof(argv[++i]);
+        } else if (!GotPath) {
+            Path = argv[i];
+            GotPath = true;
+        } else {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (Days <= 0 || Step <= 0.0f || Tolerance <= 0.0f) {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    FILE *File = fopen(Path, "r");
+    if (!File) {
+        fprintf(stderr, "Failed to open %s\n", Path);
+        return 1;
+    }
+    world *World = (world *) malloc(sizeof(world));
+    ReadWorldFile(World, File);
+    fclose(File);
+    for (int i = 0; i < World->Count; ++i)
+        WorldRectify(World, i);
+
+    double InitialAxis[MAX_BODY];
+    for (int i = 0; i < World->Count; ++i)
+        if (World->Parent[i] != NO_PARENT)
+            InitialAxis[i] = SemiMajorAxis(World, i);
+
+    int Steps = (int) ceilf(Days * SECONDS_PER_DAY / Step);
+    for (int i = 0; i < Steps; ++i)
+        WorldStep(World, Step);
+
+    printf("%d days in %d steps of %g s\n", Days, Steps, Step);
+
+    bool Drifted = false;
+    for (int i = 0; i < World->Count; ++i) {
+        if (World->Parent[i] == NO_PARENT)
+            continue;
+        double Axis = SemiMajorAxis(World, i);
+        double Drift = 100.0 * (Axis / InitialAxis[i] - 1.0);
+        bool TooFar = fabs(Drift) > Tolerance;
+        printf("%-*.*s %12.0f km %12.0f km %+8.3f%%%s\n",
+                MAX_NAME,
+                MAX_NAME,
+                World->Name[i],
+                InitialAxis[i],
+                Axis,
+                Drift,
+                TooFar ? "  too far" : "");
+        Drifted = Drifted || TooFar;
+    }
+
+    free(World);
+
+    return Drifted ? 1 : 0;
+}
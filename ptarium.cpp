@@ -1,6 +1,8 @@
 #include "camera.h"
+#include "capture.h"
 #include "file.h"
 #include "maths.h"
+#include "stars.h"
 #include "world.h"
 #include "shaders.inc"
 
@@ -14,9 +16,16 @@
 #include <glm/gtx/rotate_vector.hpp>
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define DISPLAY_WIDTH 1080
 #define DISPLAY_HEIGHT 720
+#define MAX_RESIDENT_STARS (1 << 24)
+#define MAX_STEPS_PER_FRAME 100
+#define DEFAULT_TARGET_FPS 60
+// Wake up now and then even when idle, in case of missed events
+#define IDLE_TIMEOUT_MS 1000
 
 static bool GlobalUsingMessageCallback;
 
@@ -82,29 +91,38 @@ DebugGLError(const char *Filename, int Line)
     }
 }
 
+#ifdef NDEBUG
+#define DEBUG_GL()
+#else
 #define DEBUG_GL() DebugGLError(__FILE__, __LINE__)
+#endif
 
 GLuint
-ShadersCompile()
+ShadersCompile(
+        const char *Name,
+        unsigned char *VertexText,
+        unsigned int VertexLength,
+        unsigned char *FragmentText,
+        unsigned int FragmentLength)
 {
-    GLchar *VertexSource = (GLchar *) shader_vert;
-    GLchar *FragmentSource = (GLchar *) shader_frag;
+    GLchar *VertexSource = (GLchar *) VertexText;
+    GLchar *FragmentSource = (GLchar *) FragmentText;
 
     GLuint VertexShader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(VertexShader, 1, &VertexSource, (GLint *) &shader_vert_len);
+    glShaderSource(VertexShader, 1, &VertexSource, (GLint *) &VertexLength);
     glCompileShader(VertexShader);
 
     GLuint FragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(FragmentShader, 1, &FragmentSource, (GLint *) &shader_frag_len);
+    glShaderSource(FragmentShader, 1, &FragmentSource, (GLint *) &FragmentLength);
     glCompileShader(FragmentShader);
 
     GLint Status;
     glGetShaderiv(VertexShader, GL_COMPILE_STATUS, &Status);
     if (GL_TRUE != Status)
-        printf("Vertex shader failed to compile\n");
+        printf("%s vertex shader failed to compile\n", Name);
     glGetShaderiv(FragmentShader, GL_COMPILE_STATUS, &Status);
     if (GL_TRUE != Status)
-        printf("Fragment shader failed to compile\n");
+        printf("%s fragment shader failed to compile\n", Name);
 
     GLuint Program = glCreateProgram();
     glAttachShader(Program, VertexShader);
@@ -113,7 +131,7 @@ ShadersCompile()
 
     glGetProgramiv(Program, GL_LINK_STATUS, &Status);
     if (GL_TRUE != Status)
-        printf("Shader program failed to link\n");
+        printf("%s shader program failed to link\n", Name);
 
     return Program;
 }
@@ -208,9 +226,81 @@ MeshSphereCreate(mesh *Mesh, int ParallellCount, int MeridianCount)
     *Vertex++ = 0.0f;
 }
 
+void
+PrintUsage(const char *Program)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -record PREFIX   Write each frame to PREFIX00000.ppm, ...\n"
+            "  -raw FILE        Write frames to FILE as raw rgb24 video\n"
+            "  -size WxH        Capture resolution (default is the window size)\n"
+            "  -frames N        Quit after capturing N frames\n"
+            "  -headless        Don't show the window while capturing\n"
+            "  -simulate        Start with the simulation running\n"
+            "  -stars FILE      Draw the star catalog made by starpack\n"
+            "  -fps N           Limit the frame rate, 0 for no limit (default %d)\n"
+            "\n"
+            "To record without a display, run with SDL_VIDEODRIVER=offscreen\n"
+            "so that SDL creates the context through EGL. While capturing, every\n"
+            "frame advances the simulation by the same amount, as if it ran at\n"
+            "the -fps rate.\n",
+            Program,
+            DEFAULT_TARGET_FPS);
+}
+
 int
 main(int argc, char *argv[])
 {
+    const char *CapturePath = 0;
+    capture_format CaptureFormat = CAPTURE_PPM_SEQUENCE;
+    int CaptureWidth = 0;
+    int CaptureHeight = 0;
+    int CaptureFrameLimit = 0;
+    bool Headless = false;
+    bool Simulating = false;
+    const char *StarPath = 0;
+    int TargetFps = DEFAULT_TARGET_FPS;
+
+    for (int i = 1; i < argc; ++i) {
+        bool HasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "-record") && HasValue) {
+            CapturePath = argv[++i];
+            CaptureFormat = CAPTURE_PPM_SEQUENCE;
+        } else if (!strcmp(argv[i], "-raw") && HasValue) {
+            CapturePath = argv[++i];
+            CaptureFormat = CAPTURE_RAW_VIDEO;
+        } else if (!strcmp(argv[i], "-size") && HasValue) {
+            if (sscanf(argv[++i], "%dx%d", &CaptureWidth, &CaptureHeight) != 2
+                    || CaptureWidth <= 0 || CaptureHeight <= 0) {
+                PrintUsage(argv[0]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-frames") && HasValue) {
+            CaptureFrameLimit = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-stars") && HasValue) {
+            StarPath = argv[++i];
+        } else if (!strcmp(argv[i], "-fps") && HasValue) {
+            TargetFps = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-headless")) {
+            Headless = true;
+        } else if (!strcmp(argv[i], "-simulate")) {
+            Simulating = true;
+        } else {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    bool Capturing = CapturePath != 0;
+    if (!Capturing && (Headless || CaptureWidth || CaptureFrameLimit)) {
+        fprintf(stderr, "-headless, -size and -frames require -record or -raw\n");
+        return 1;
+    }
+    if (!CaptureWidth) {
+        CaptureWidth = DISPLAY_WIDTH;
+        CaptureHeight = DISPLAY_HEIGHT;
+    }
+
     FILE *File = fopen("planets.csv", "r");
     world *World = (world *) malloc(sizeof(world));
     ReadWorldFile(World, File);
@@ -224,21 +314,48 @@ main(int argc, char *argv[])
 #endif
 
 #if 1
+    // Planets are drawn bigger than life so they can be seen at all, but
+    // never so big that they swallow their moons. Moons keep their true
+    // size.
+    float RadiusScale[MAX_BODY];
+    for (int i = 0; i < World->Count; ++i)
+        RadiusScale[i] = World->Parent[i] == NO_PARENT ? 100.0f : 1.0f;
     for (int i = 0; i < World->Count; ++i) {
-        World->Radius[i] *= 100.0f;
+        int Parent = World->Parent[i];
+        if (Parent != NO_PARENT) {
+            float Room = 0.5f * glm::length(World->Position[i]) / World->Radius[Parent];
+            RadiusScale[Parent] = glm::clamp(Room, 1.0f, RadiusScale[Parent]);
+        }
+    }
+    for (int i = 0; i < World->Count; ++i) {
+        World->Radius[i] *= RadiusScale[i];
     }
 #endif
 
+    // The file only has states, so every moon starts on the two body
+    // orbit through its initial state
+    for (int i = 0; i < World->Count; ++i)
+        WorldRectify(World, i);
+    WorldReorder(World);
+
     printf("World has %d objects\n", World->Count);
 
     SDL_Init(SDL_INIT_VIDEO);
     SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
     SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
     SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+#ifdef NDEBUG
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_FLAGS, SDL_GL_CONTEXT_FORWARD_COMPATIBLE_FLAG);
+#else
     SDL_GL_SetAttribute(SDL_GL_CONTEXT_FLAGS,
             SDL_GL_CONTEXT_FORWARD_COMPATIBLE_FLAG | SDL_GL_CONTEXT_DEBUG_FLAG);
-    SDL_GL_SetAttribute(SDL_GL_MULTISAMPLEBUFFERS, 1);
-    SDL_GL_SetAttribute(SDL_GL_MULTISAMPLESAMPLES, 4);
+#endif
+    // When capturing, the offscreen target does the multisampling and the
+    // window only gets a scaled copy of it.
+    if (!Capturing) {
+        SDL_GL_SetAttribute(SDL_GL_MULTISAMPLEBUFFERS, 1);
+        SDL_GL_SetAttribute(SDL_GL_MULTISAMPLESAMPLES, 4);
+    }
 
     SDL_Window *Window = SDL_CreateWindow(
             "ptarium",
@@ -246,7 +363,7 @@ main(int argc, char *argv[])
             SDL_WINDOWPOS_CENTERED,
             DISPLAY_WIDTH,
             DISPLAY_HEIGHT,
-            SDL_WINDOW_OPENGL);
+            SDL_WINDOW_OPENGL | (Headless ? SDL_WINDOW_HIDDEN : SDL_WINDOW_SHOWN));
     SDL_GLContext GLContext = SDL_GL_CreateContext(Window);
 
     // Also load extensions not reported by driver
@@ -259,13 +376,28 @@ main(int argc, char *argv[])
     if (GLEW_KHR_debug) {
         fprintf(stderr, "Debug messages enabled.\n");
         glEnable(GL_DEBUG_OUTPUT);
+#ifdef NDEBUG
+        // Only errors, reported from whichever thread the driver likes
+        glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0, 0, GL_FALSE);
+        glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_HIGH, 0, 0, GL_TRUE);
+#else
         glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+#endif
         glDebugMessageCallback(DebugMessageCallback, 0);
         GlobalUsingMessageCallback = true;
     }
 
+    capture Capture;
+    if (Capturing && !CaptureCreate(&Capture, CaptureWidth, CaptureHeight, 4, CaptureFormat, CapturePath))
+        return 1;
+
+    star_catalog Stars;
+    if (StarPath && !StarCatalogOpen(&Stars, StarPath, MAX_RESIDENT_STARS))
+        return 1;
+
     glEnable(GL_DEPTH_TEST);
     glEnable(GL_MULTISAMPLE);
+    glEnable(GL_PROGRAM_POINT_SIZE);
     glEnable(GL_LINE_SMOOTH);
     glLineWidth(0.5f);
 
@@ -313,11 +445,20 @@ main(int argc, char *argv[])
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, SphereIndBuf);
     glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort) * Sphere.IndexCount, Sphere.Indices, GL_STATIC_DRAW);
 
-    GLuint ShaderProgram = ShadersCompile();
-    glUseProgram(ShaderProgram);
+    GLuint ShaderProgram = ShadersCompile(
+            "Body",
+            shader_vert, shader_vert_len,
+            shader_frag, shader_frag_len);
+    GLuint StarProgram = ShadersCompile(
+            "Star",
+            star_vert, star_vert_len,
+            star_frag, star_frag_len);
 
     camera_params CameraParams;
-    CameraParams.AspectRatio = (float) DISPLAY_WIDTH / (float) DISPLAY_HEIGHT;
+    if (Capturing)
+        CameraParams.AspectRatio = (float) CaptureWidth / (float) CaptureHeight;
+    else
+        CameraParams.AspectRatio = (float) DISPLAY_WIDTH / (float) DISPLAY_HEIGHT;
     CameraParams.FovY = glm::radians(80.0f);
 
     CameraParams.Orientation = {0.0f, PI / 2};
@@ -325,34 +466,68 @@ main(int argc, char *argv[])
 
     GLuint TransformLocation = glGetUniformLocation(ShaderProgram, "Transform");
     GLuint ColorLocation = glGetUniformLocation(ShaderProgram, "Color");
+    GLuint StarTransformLocation = glGetUniformLocation(StarProgram, "Transform");
+    GLuint MagnitudeLimitLocation = glGetUniformLocation(StarProgram, "MagnitudeLimit");
     DEBUG_GL();
 
     Uint64 PerformanceHz = SDL_GetPerformanceFrequency();
     Uint64 LastTime = SDL_GetPerformanceCounter();
     Uint64 LastPrint = LastTime;
     Uint64 PrintDist = PerformanceHz;
+    Uint64 FrameTicks = TargetFps > 0 ? PerformanceHz / TargetFps : 0;
+    Uint64 NextFrame = LastTime;
     float FrameLength = 0.0f;
+    float CaptureFps = TargetFps > 0 ? (float) TargetFps : (float) DEFAULT_TARGET_FPS;
 
     bool PrintFrameTime = false;
     bool Running = true;
     bool Wireframe = false;
     bool DebugMouseTracing = false;
 
+    // Body id rather than index, so it survives WorldReorder
     int FocusedBody = 0;
+    float MagnitudeLimit = 6.5f;
+
+    float TimeScale = 86400.0f;
+    glm::vec3 AbsolutePosition[MAX_BODY];
+
+    // Only redraw when something changed, or while something is moving
+    bool Redraw = true;
+    bool StarsPending = false;
+    bool PrintClickedBody = false;
 
     while (Running) {
+        bool Animating = Simulating || Capturing || StarsPending;
+        Uint64 Now = SDL_GetPerformanceCounter();
+
+        if (!Animating && !Redraw) {
+            SDL_WaitEventTimeout(0, IDLE_TIMEOUT_MS);
+            // The idle time shouldn't count as a long frame
+            LastTime = SDL_GetPerformanceCounter();
+        } else if (!Capturing && Now < NextFrame) {
+            Uint64 WaitMs = ((NextFrame - Now) * 1000 + PerformanceHz - 1) / PerformanceHz;
+            SDL_WaitEventTimeout(0, (int) WaitMs);
+        }
+
         SDL_Event Event;
         float dAngle = glm::radians(5.0f);
-        bool PrintClickedBody = false;
         while (SDL_PollEvent(&Event)) {
             switch (Event.type) {
                 case SDL_QUIT:
                     Running = false;
                     break;
+                case SDL_WINDOWEVENT:
+                    Redraw = true;
+                    break;
+                case SDL_MOUSEMOTION:
+                    if (DebugMouseTracing)
+                        Redraw = true;
+                    break;
                 case SDL_MOUSEBUTTONDOWN:
                     PrintClickedBody = true;
                 case SDL_KEYDOWN:
                     {
+                    Redraw = true;
                     switch (Event.key.keysym.sym) {
                         case SDLK_ESCAPE:
                             Running = false;
@@ -392,6 +567,35 @@ main(int argc, char *argv[])
                             FocusedBody = Event.key.keysym.sym - SDLK_0;
                             printf("Focus %d\n", FocusedBody);
                             break;
+                        case SDLK_BACKSPACE:
+                            if (FocusedBody < World->Count) {
+                                int Parent = World->Parent[World->IndexOfId[FocusedBody]];
+                                if (Parent != NO_PARENT)
+                                    FocusedBody = World->Id[Parent];
+                            }
+                            printf("Focus %d\n", FocusedBody);
+                            break;
+                        case SDLK_RETURN:
+                            if (FocusedBody < World->Count)
+                                FocusedBody = World->Id[WorldFirstChild(World, World->IndexOfId[FocusedBody])];
+                            printf("Focus %d\n", FocusedBody);
+                            break;
+                        case SDLK_TAB:
+                            if (FocusedBody < World->Count)
+                                FocusedBody = World->Id[WorldNextSibling(World, World->IndexOfId[FocusedBody])];
+                            printf("Focus %d\n", FocusedBody);
+                            break;
+                        case SDLK_SPACE:
+                            Simulating = !Simulating;
+                            break;
+                        case SDLK_COMMA:
+                            TimeScale *= 0.5f;
+                            printf("Time scale: %.0f s/s\n", TimeScale);
+                            break;
+                        case SDLK_PERIOD:
+                            TimeScale *= 2.0f;
+                            printf("Time scale: %.0f s/s\n", TimeScale);
+                            break;
                         case SDLK_PLUS:
                             CameraParams.Distance += 1.0f;
                             printf("Camera distance: %f\n", CameraParams.Distance);
@@ -400,11 +604,32 @@ main(int argc, char *argv[])
                             CameraParams.Distance -= 1.0f;
                             printf("Camera distance: %f\n", CameraParams.Distance);
                             break;
+                        case SDLK_LEFTBRACKET:
+                            MagnitudeLimit -= 0.5f;
+                            printf("Magnitude limit: %.1f\n", MagnitudeLimit);
+                            break;
+                        case SDLK_RIGHTBRACKET:
+                            MagnitudeLimit += 0.5f;
+                            printf("Magnitude limit: %.1f\n", MagnitudeLimit);
+                            break;
                     }
                 }
             }
         }
 
+        Animating = Simulating || Capturing || StarsPending;
+        if (!Running || (!Animating && !Redraw))
+            continue;
+
+        // Input that arrives early waits for the next frame too
+        Now = SDL_GetPerformanceCounter();
+        if (!Capturing && Now < NextFrame)
+            continue;
+        NextFrame += FrameTicks;
+        if (NextFrame < Now)
+            NextFrame = Now + FrameTicks;
+        Redraw = false;
+
         int MouseX, MouseY;
         SDL_GetMouseState(&MouseX, &MouseY);
 
@@ -412,38 +637,57 @@ main(int argc, char *argv[])
                 (float) MouseX / (float) DISPLAY_WIDTH,
                 1.0f - (float) MouseY / (float) DISPLAY_HEIGHT);
 
-#if 0
-        for (int i = 0; i < World->Count; ++i) {
-            for (int j = 0; j < i; ++j) {
-                float G = 6.674e-11;
-                glm::vec3 Delta = World->Position[j] - World->Position[i];
-                float Distance = glm::length(Delta);
-                glm::vec3 Normal = glm::normalize(Delta);
-                // TODO: Divide by zero/tiny?
-                float ForceWithoutMass = G / (Distance*Distance);
-                glm::vec3 DeltaVelocityWithoutMass = ForceWithoutMass*FrameLength*Normal;
-                World->Velocity[i] += DeltaVelocityWithoutMass*World->Mass[j];
-                World->Velocity[j] -= DeltaVelocityWithoutMass*World->Mass[i];
+        if (Simulating) {
+            // A recording plays back at a fixed rate, so each frame gets
+            // the same simulated time however long it took to render,
+            // and none of it is ever dropped.
+            float SimulationTime = Capturing
+                ? TimeScale / CaptureFps
+                : TimeScale * FrameLength;
+            // Every frame moves the world by all of its time, in steps of
+            // at most SIMULATION_STEP, so that frames owed less than a
+            // full step don't repeat the previous one. Interactively, time
+            // beyond MAX_STEPS_PER_FRAME is dropped rather than falling
+            // behind.
+            int Steps = 0;
+            while (SimulationTime > 0.0f
+                    && (Capturing || Steps < MAX_STEPS_PER_FRAME)) {
+                float Step = glm::min(SimulationTime, SIMULATION_STEP);
+                WorldStep(World, Step);
+                SimulationTime -= Step;
+                Steps++;
             }
         }
-#endif
 
-#if 0
-        for (int i = 0; i < World->Count; ++i) {
-            World->Position[i] += World->Velocity[i];
-        }
-#endif
+        WorldAbsolutePositions(World, AbsolutePosition);
 
         if (FocusedBody < World->Count) {
-            CameraParams.Focus = World->Position[FocusedBody];
-            CameraParams.Distance = 2.0f * World->Radius[FocusedBody];
-            CameraParams.NearDistance = 0.9f * World->Radius[FocusedBody];
+            int Focused = World->IndexOfId[FocusedBody];
+            CameraParams.Focus = AbsolutePosition[Focused];
+            CameraParams.Distance = 2.0f * World->Radius[Focused];
+            CameraParams.NearDistance = 0.9f * World->Radius[Focused];
         }
 
         camera Camera = CameraParams.MakeCamera();
 
+        if (Capturing)
+            CaptureBegin(&Capture);
+
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+        if (StarPath) {
+            StarsPending = StarCatalogUpdate(&Stars, &Camera, MagnitudeLimit);
+
+            // Stars end up exactly on the far plane, behind everything
+            glDisable(GL_DEPTH_TEST);
+            glUseProgram(StarProgram);
+            glUniformMatrix4fv(StarTransformLocation, 1, GL_FALSE, &Camera.FullTransform[0][0]);
+            glUniform1f(MagnitudeLimitLocation, MagnitudeLimit);
+            StarCatalogDraw(&Stars);
+            glEnable(GL_DEPTH_TEST);
+        }
+
+        glUseProgram(ShaderProgram);
         glEnableVertexAttribArray(0);
 
         glBindBuffer(GL_ARRAY_BUFFER, SphereVertBuf);
@@ -451,7 +695,7 @@ main(int argc, char *argv[])
 
         for (int i = 0; i < World->Count; ++i) {
             glm::mat4 ScaleTransform = glm::scale(glm::mat4(1.0f), glm::vec3(World->Radius[i]));
-            glm::mat4 TranslateTransform = glm::translate(glm::mat4(1.0f), World->Position[i]);
+            glm::mat4 TranslateTransform = glm::translate(glm::mat4(1.0f), AbsolutePosition[i]);
             glm::mat4 MVPTransform = Camera.FullTransform * TranslateTransform * ScaleTransform;
             glUniformMatrix4fv(TransformLocation, 1, GL_FALSE, &MVPTransform[0][0]);
             glUniform3f(ColorLocation, World->Color[i].x, World->Color[i].y, World->Color[i].z);
@@ -464,13 +708,14 @@ main(int argc, char *argv[])
             for (int i = 0; i < World->Count; ++i) {
                 // TODO: Closest
                 int Result = LineSphereIntersect(
-                        World->Position[i],
+                        AbsolutePosition[i],
                         World->Radius[i],
                         Camera.Position,
                         WorldPointingDir);
                 if (Result == 1)
                     printf("%s\n", World->Name[i]);
             }
+            PrintClickedBody = false;
         }
 
         glm::vec3 Line0 = Camera.Position + 2.0f * CameraParams.NearDistance * Camera.LookVector;
@@ -504,6 +749,13 @@ main(int argc, char *argv[])
 
         glDisableVertexAttribArray(0);
 
+        if (Capturing) {
+            if (!CaptureEnd(&Capture, DISPLAY_WIDTH, DISPLAY_HEIGHT, !Headless))
+                Running = false;
+            if (CaptureFrameLimit && Capture.FrameCount >= CaptureFrameLimit)
+                Running = false;
+        }
+
         DEBUG_GL();
 
         Uint64 CurrentTime = SDL_GetPerformanceCounter();
@@ -515,8 +767,13 @@ main(int argc, char *argv[])
         }
         LastTime = CurrentTime;
 
-        SDL_GL_SwapWindow(Window);
+        if (!Headless)
+            SDL_GL_SwapWindow(Window);
     }
 
-    return 0;
+    bool Captured = !Capturing || CaptureDestroy(&Capture);
+    if (StarPath)
+        StarCatalogClose(&Stars);
+
+    return Captured ? 0 : 1;
 }
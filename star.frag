@@ -0,0 +1,10 @@
+#version 330 core
+
+in vec3 Color;
+
+out vec3 OutColor;
+
+void main()
+{
+    OutColor = Color;
+}
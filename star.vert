@@ -0,0 +1,21 @@
+#version 330 core
+
+layout(location = 0) in vec3 Direction;
+layout(location = 1) in float Magnitude;
+layout(location = 2) in vec4 StarColor;
+
+out vec3 Color;
+
+uniform mat4 Transform;
+uniform float MagnitudeLimit;
+
+void main()
+{
+    // Directions are at infinity, so only the rotation applies
+    gl_Position = Transform * vec4(Direction, 0.0);
+
+    float Brighter = MagnitudeLimit - Magnitude;
+    float Intensity = Brighter < 0.0 ? 0.0 : clamp(0.2 * pow(2.512, Brighter), 0.0, 1.0);
+    gl_PointSize = clamp(1.0 + 0.5 * Brighter, 1.0, 6.0);
+    Color = Intensity * StarColor.rgb;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+
+// Preprocessed star catalog, as written by starpack:
+//
+//   star_file_header
+//   star_tile_entry[TileCount]
+//   star_record[StarCount]
+//
+// The sky is split into cube face tiles, TileResolution^2 per face, with
+// the stars of each tile stored contiguously and sorted by magnitude.
+// All directions are unit vectors in the ecliptic J2000 frame.
+
+#define STAR_FILE_MAGIC "PTSTARS1"
+#define STAR_MAGNITUDE_MIN -2
+#define STAR_MAGNITUDE_BINS 32
+
+struct star_file_header {
+    char Magic[8];
+    uint32_t TileResolution;
+    uint32_t TileCount;
+    uint64_t StarCount;
+};
+
+struct star_tile_entry {
+    uint64_t FirstStar;
+    // Stars in the tile brighter than STAR_MAGNITUDE_MIN + Bin + 1. The
+    // last bin counts every star in the tile.
+    uint32_t Count[STAR_MAGNITUDE_BINS];
+};
+
+struct star_record {
+    float Direction[3];
+    float Magnitude;
+    uint8_t Color[4];
+};
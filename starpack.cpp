@@ -0,0 +1,273 @@
+/* Converts a star catalog CSV into the tiled binary format read by
+ * StarCatalogOpen.
+ *
+ * Each input line is "ra,dec,mag[,bv]" with the right ascension and
+ * declination in degrees (J2000) and an optional B-V color index, which
+ * is how Gaia and HYG exports can be cut down with any CSV tool. Lines
+ * starting with '#' and lines that don't parse are skipped.
+ *
+ * The catalog doesn't have to fit in memory: the first pass converts
+ * every star to a temporary file and counts the tiles, and the second
+ * pass gathers and sorts as many whole tiles at a time as the memory
+ * budget allows. */
+
+#include "file.h"
+#include "maths.h"
+#include "starfile.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_TILE_RESOLUTION 16
+#define DEFAULT_BUDGET_MB 256
+#define READ_CHUNK 4096
+
+// Obliquity of the ecliptic at J2000
+#define OBLIQUITY 0.40909280f
+#define RADIANS_PER_DEGREE 0.017453293f
+
+struct packed_star {
+    uint32_t Tile;
+    star_record Star;
+};
+
+struct color_stop {
+    float ColorIndex;
+    uint8_t Color[3];
+};
+
+static const color_stop ColorStops[] = {
+    {-0.33f, {155, 176, 255}},
+    { 0.00f, {202, 216, 255}},
+    { 0.30f, {248, 247, 255}},
+    { 0.60f, {255, 244, 234}},
+    { 0.90f, {255, 222, 180}},
+    { 1.40f, {255, 190, 127}},
+    { 2.00f, {255, 160,  90}},
+};
+
+static void
+ColorFromColorIndex(uint8_t Color[4], float ColorIndex)
+{
+    const int StopCount = sizeof(ColorStops) / sizeof(ColorStops[0]);
+    int Stop = 0;
+
+    while (Stop < StopCount - 2 && ColorIndex > ColorStops[Stop + 1].ColorIndex)
+        Stop++;
+
+    const color_stop *Low = &ColorStops[Stop];
+    const color_stop *High = &ColorStops[Stop + 1];
+    float T = (ColorIndex - Low->ColorIndex) / (High->ColorIndex - Low->ColorIndex);
+    T = glm::clamp(T, 0.0f, 1.0f);
+
+    for (int i = 0; i < 3; ++i)
+        Color[i] = (uint8_t) (Low->Color[i] + T * (High->Color[i] - Low->Color[i]));
+    Color[3] = 255;
+}
+
+static bool
+ParseStar(star_record *Star, char *Line)
+{
+    char *Fields[4];
+    float RightAscension, Declination, ColorIndex;
+
+    int FieldCount = GetCsvFields(Fields, Line, 4);
+    if (FieldCount < 3 || FieldCount > 4)
+        return false;
+    if (sscanf(Fields[0], "%f", &RightAscension) != 1
+            || sscanf(Fields[1], "%f", &Declination) != 1
+            || sscanf(Fields[2], "%f", &Star->Magnitude) != 1
+            || Star->Magnitude != Star->Magnitude)
+        return false;
+
+    if (FieldCount == 4 && sscanf(Fields[3], "%f", &ColorIndex) == 1) {
+        ColorFromColorIndex(Star->Color, ColorIndex);
+    } else {
+        memset(Star->Color, 255, sizeof(Star->Color));
+    }
+
+    RightAscension *= RADIANS_PER_DEGREE;
+    Declination *= RADIANS_PER_DEGREE;
+    glm::vec3 Equatorial(
+            cosf(Declination) * cosf(RightAscension),
+            cosf(Declination) * sinf(RightAscension),
+            sinf(Declination));
+
+    Star->Direction[0] = Equatorial.x;
+    Star->Direction[1] = cosf(OBLIQUITY) * Equatorial.y + sinf(OBLIQUITY) * Equatorial.z;
+    Star->Direction[2] = -sinf(OBLIQUITY) * Equatorial.y + cosf(OBLIQUITY) * Equatorial.z;
+
+    return true;
+}
+
+static int
+CompareMagnitude(const void *A, const void *B)
+{
+    float MagnitudeA = ((const star_record *) A)->Magnitude;
+    float MagnitudeB = ((const star_record *) B)->Magnitude;
+    return (MagnitudeA > MagnitudeB) - (MagnitudeA < MagnitudeB);
+}
+
+static void
+PrintUsage(const char *Program)
+{
+    fprintf(stderr,
+            "Usage: %s [-tiles N] [-budget MB] input.csv output.bin\n"
+            "  -tiles N     Tiles along each cube face edge (default %d)\n"
+            "  -budget MB   Memory used for sorting (default %d)\n",
+            Program,
+            DEFAULT_TILE_RESOLUTION,
+            DEFAULT_BUDGET_MB);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int TileResolution = DEFAULT_TILE_RESOLUTION;
+    int BudgetMB = DEFAULT_BUDGET_MB;
+    const char *InputPath = 0;
+    const char *OutputPath = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-tiles") && i + 1 < argc) {
+            TileResolution = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-budget") && i + 1 < argc) {
+            BudgetMB = atoi(argv[++i]);
+        } else if (!InputPath) {
+            InputPath = argv[i];
+        } else if (!OutputPath) {
+            OutputPath = argv[i];
+        } else {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!OutputPath || TileResolution <= 0 || BudgetMB <= 0) {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    FILE *Input = fopen(InputPath, "r");
+    if (!Input) {
+        fprintf(stderr, "Failed to open %s\n", InputPath);
+        return 1;
+    }
+
+    FILE *Temporary = tmpfile();
+    if (!Temporary) {
+        fprintf(stderr, "Failed to create temporary file\n");
+        return 1;
+    }
+
+    star_file_header Header;
+    memset(&Header, 0, sizeof(Header));
+    memcpy(Header.Magic, STAR_FILE_MAGIC, sizeof(Header.Magic));
+    Header.TileResolution = TileResolution;
+    Header.TileCount = 6 * TileResolution * TileResolution;
+
+    star_tile_entry *Entries = (star_tile_entry *) calloc(Header.TileCount, sizeof(star_tile_entry));
+
+    // Pass 1: parse, tile and count
+    char Line[MAX_LINE];
+    int Lineno = 0;
+    int Skipped = 0;
+    for (;;) {
+        int Length = GetLine(Line, Input);
+        if (!Length && feof(Input))
+            break;
+        Lineno++;
+        if (!Length || *Line == '#')
+            continue;
+
+        packed_star Packed;
+        if (!ParseStar(&Packed.Star, Line)) {
+            Skipped++;
+            continue;
+        }
+
+        glm::vec3 Direction(Packed.Star.Direction[0], Packed.Star.Direction[1], Packed.Star.Direction[2]);
+        Packed.Tile = CubeTileFromDirection(Direction, TileResolution);
+        fwrite(&Packed, sizeof(Packed), 1, Temporary);
+
+        int Bin = (int) floorf(Packed.Star.Magnitude - STAR_MAGNITUDE_MIN);
+        Bin = glm::clamp(Bin, 0, STAR_MAGNITUDE_BINS - 1);
+        for (; Bin < STAR_MAGNITUDE_BINS; ++Bin)
+            Entries[Packed.Tile].Count[Bin]++;
+        Header.StarCount++;
+    }
+    fclose(Input);
+
+    printf("Read %llu stars from %d lines, skipped %d\n",
+            (unsigned long long) Header.StarCount,
+            Lineno,
+            Skipped);
+
+    uint64_t FirstStar = 0;
+    uint32_t LargestTile = 0;
+    for (uint32_t i = 0; i < Header.TileCount; ++i) {
+        uint32_t TileCount = Entries[i].Count[STAR_MAGNITUDE_BINS - 1];
+        Entries[i].FirstStar = FirstStar;
+        FirstStar += TileCount;
+        LargestTile = glm::max(LargestTile, TileCount);
+    }
+
+    FILE *Output = fopen(OutputPath, "wb");
+    if (!Output) {
+        fprintf(stderr, "Failed to open %s for writing\n", OutputPath);
+        return 1;
+    }
+    fwrite(&Header, sizeof(Header), 1, Output);
+    fwrite(Entries, sizeof(star_tile_entry), Header.TileCount, Output);
+
+    // Pass 2: gather runs of whole tiles that fit the budget
+    uint64_t BatchCapacity = (uint64_t) BudgetMB * 1024 * 1024 / sizeof(star_record);
+    BatchCapacity = glm::max<uint64_t>(BatchCapacity, LargestTile);
+    star_record *Batch = (star_record *) malloc(sizeof(star_record) * BatchCapacity);
+    uint64_t *Cursors = (uint64_t *) malloc(sizeof(uint64_t) * Header.TileCount);
+    packed_star *Chunk = (packed_star *) malloc(sizeof(packed_star) * READ_CHUNK);
+
+    uint32_t BatchBegin = 0;
+    while (BatchBegin < Header.TileCount) {
+        uint64_t BatchFirst = Entries[BatchBegin].FirstStar;
+        uint32_t BatchEnd = BatchBegin;
+        while (BatchEnd < Header.TileCount
+                && Entries[BatchEnd].FirstStar + Entries[BatchEnd].Count[STAR_MAGNITUDE_BINS - 1]
+                    - BatchFirst <= BatchCapacity)
+            BatchEnd++;
+
+        for (uint32_t i = BatchBegin; i < BatchEnd; ++i)
+            Cursors[i] = Entries[i].FirstStar - BatchFirst;
+
+        rewind(Temporary);
+        size_t ChunkCount;
+        while ((ChunkCount = fread(Chunk, sizeof(packed_star), READ_CHUNK, Temporary))) {
+            for (size_t i = 0; i < ChunkCount; ++i) {
+                uint32_t Tile = Chunk[i].Tile;
+                if (Tile >= BatchBegin && Tile < BatchEnd)
+                    Batch[Cursors[Tile]++] = Chunk[i].Star;
+            }
+        }
+
+        for (uint32_t i = BatchBegin; i < BatchEnd; ++i)
+            qsort(Batch + (Entries[i].FirstStar - BatchFirst),
+                    Entries[i].Count[STAR_MAGNITUDE_BINS - 1],
+                    sizeof(star_record),
+                    CompareMagnitude);
+
+        uint64_t BatchSize = Cursors[BatchEnd - 1];
+        fwrite(Batch, sizeof(star_record), BatchSize, Output);
+
+        printf("Wrote tiles %u-%u\n", BatchBegin, BatchEnd - 1);
+        BatchBegin = BatchEnd;
+    }
+
+    fclose(Temporary);
+    if (fclose(Output)) {
+        fprintf(stderr, "Failed to write %s\n", OutputPath);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,379 @@
+#include "stars.h"
+#include "maths.h"
+#include <SDL2/SDL.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define fseek64 _fseeki64
+#else
+#define fseek64 fseeko
+#endif
+
+// Stars requested from the loader per frame, so turning the camera never
+// queues up a whole sky worth of tiles at once.
+#define STAR_LOAD_BUDGET (1 << 18)
+// Smallest tile buffer, in stars
+#define STAR_MIN_CAPACITY 1024
+
+// Owns the file once the catalog is open. Reads never happen on the
+// render thread.
+static int
+StarLoaderMain(void *Data)
+{
+    star_catalog *Catalog = (star_catalog *) Data;
+    int64_t StarsOffset = sizeof(star_file_header)
+        + sizeof(star_tile_entry) * Catalog->Header.TileCount;
+
+    for (;;) {
+        SDL_LockMutex(Catalog->Lock);
+        while (!Catalog->RequestCount && !Catalog->Finished)
+            SDL_CondWait(Catalog->QueueChanged, Catalog->Lock);
+        if (!Catalog->RequestCount) {
+            SDL_UnlockMutex(Catalog->Lock);
+            break;
+        }
+        star_load Load = Catalog->Requests[Catalog->RequestHead];
+        Catalog->RequestHead = (Catalog->RequestHead + 1) % STAR_LOAD_QUEUE_LENGTH;
+        Catalog->RequestCount--;
+        SDL_UnlockMutex(Catalog->Lock);
+
+        int64_t Offset = StarsOffset + sizeof(star_record) * Load.FirstStar;
+        Load.Failed = fseek64(Catalog->File, Offset, SEEK_SET)
+            || fread(Load.Stars, sizeof(star_record), Load.Count, Catalog->File) != Load.Count;
+
+        // At most STAR_LOAD_QUEUE_LENGTH loads are in flight, so this
+        // never overflows.
+        SDL_LockMutex(Catalog->Lock);
+        int Tail = (Catalog->CompletedHead + Catalog->CompletedCount) % STAR_LOAD_QUEUE_LENGTH;
+        Catalog->Completed[Tail] = Load;
+        Catalog->CompletedCount++;
+        SDL_UnlockMutex(Catalog->Lock);
+    }
+
+    return 0;
+}
+
+bool
+StarCatalogOpen(star_catalog *Catalog, const char *Path, uint64_t MaxResidentStars)
+{
+    memset(Catalog, 0, sizeof(*Catalog));
+    Catalog->MaxResidentStars = MaxResidentStars;
+
+    Catalog->File = fopen(Path, "rb");
+    if (!Catalog->File) {
+        fprintf(stderr, "Failed to open star catalog %s\n", Path);
+        return false;
+    }
+
+    star_file_header *Header = &Catalog->Header;
+    if (fread(Header, sizeof(*Header), 1, Catalog->File) != 1
+            || memcmp(Header->Magic, STAR_FILE_MAGIC, sizeof(Header->Magic))
+            || Header->TileCount != 6 * Header->TileResolution * Header->TileResolution) {
+        fprintf(stderr, "%s is not a star catalog\n", Path);
+        return false;
+    }
+
+    Catalog->Entries = (star_tile_entry *) malloc(sizeof(star_tile_entry) * Header->TileCount);
+    if (fread(Catalog->Entries, sizeof(star_tile_entry), Header->TileCount, Catalog->File)
+            != Header->TileCount) {
+        fprintf(stderr, "%s: truncated tile index\n", Path);
+        return false;
+    }
+
+    Catalog->Tiles = (star_tile *) calloc(Header->TileCount, sizeof(star_tile));
+    for (uint32_t i = 0; i < Header->TileCount; ++i) {
+        star_tile *Tile = &Catalog->Tiles[i];
+        Tile->Center = CubeTileDirection(i, Header->TileResolution, 0.5f, 0.5f);
+        for (int Corner = 0; Corner < 4; ++Corner) {
+            glm::vec3 CornerDirection = CubeTileDirection(
+                    i,
+                    Header->TileResolution,
+                    (float) (Corner & 1),
+                    (float) (Corner >> 1));
+            float Angle = acosf(glm::clamp(glm::dot(Tile->Center, CornerDirection), -1.0f, 1.0f));
+            Tile->Radius = glm::max(Tile->Radius, Angle);
+        }
+        Tile->LastVisibleFrame = -1;
+    }
+
+    Catalog->VisibleTiles = (int *) malloc(sizeof(int) * Header->TileCount);
+
+    for (int i = 0; i < STAR_LOAD_QUEUE_LENGTH; ++i)
+        Catalog->FreeChunks[i] = (star_record *) malloc(sizeof(star_record) * STAR_LOAD_CHUNK);
+    Catalog->FreeChunkCount = STAR_LOAD_QUEUE_LENGTH;
+
+    Catalog->Lock = SDL_CreateMutex();
+    Catalog->QueueChanged = SDL_CreateCond();
+    Catalog->Loader = SDL_CreateThread(StarLoaderMain, "star loader", Catalog);
+    if (!Catalog->Loader) {
+        fprintf(stderr, "Failed to start star loader: %s\n", SDL_GetError());
+        return false;
+    }
+
+    printf("Star catalog has %llu stars in %u tiles\n",
+            (unsigned long long) Header->StarCount,
+            Header->TileCount);
+
+    return true;
+}
+
+static uint32_t
+StarTileWantedCount(star_tile_entry *Entry, float MagnitudeLimit)
+{
+    int Bin = (int) ceilf(MagnitudeLimit - STAR_MAGNITUDE_MIN) - 1;
+    if (Bin < 0)
+        return 0;
+    if (Bin >= STAR_MAGNITUDE_BINS)
+        Bin = STAR_MAGNITUDE_BINS - 1;
+    return Entry->Count[Bin];
+}
+
+static void
+StarTileEvict(star_catalog *Catalog, star_tile *Tile)
+{
+    glDeleteBuffers(1, &Tile->Buffer);
+    Catalog->ResidentStars -= Tile->LoadedCount;
+    Tile->Buffer = 0;
+    Tile->Capacity = 0;
+    Tile->LoadedCount = 0;
+    Tile->DrawCount = 0;
+}
+
+// Evicts the least recently visible tiles until Count more stars fit.
+// Returns false if only visible or loading tiles are left.
+static bool
+StarCatalogMakeRoom(star_catalog *Catalog, uint64_t Count)
+{
+    while (Catalog->ResidentStars + Count > Catalog->MaxResidentStars) {
+        star_tile *Oldest = 0;
+        for (uint32_t i = 0; i < Catalog->Header.TileCount; ++i) {
+            star_tile *Tile = &Catalog->Tiles[i];
+            if (Tile->Buffer
+                    && !Tile->Loading
+                    && Tile->LastVisibleFrame < Catalog->Frame
+                    && (!Oldest || Tile->LastVisibleFrame < Oldest->LastVisibleFrame))
+                Oldest = Tile;
+        }
+        if (!Oldest)
+            return false;
+        StarTileEvict(Catalog, Oldest);
+    }
+
+    return true;
+}
+
+static void
+StarTileRequest(star_catalog *Catalog, int TileIndex, uint32_t Count)
+{
+    star_tile *Tile = &Catalog->Tiles[TileIndex];
+
+    star_load Load;
+    Load.Tile = TileIndex;
+    Load.FirstStar = Catalog->Entries[TileIndex].FirstStar + Tile->LoadedCount;
+    Load.Count = Count;
+    Load.Failed = false;
+    Load.Stars = Catalog->FreeChunks[--Catalog->FreeChunkCount];
+
+    // Counted as resident right away so in flight loads respect the cap
+    Tile->Loading = true;
+    Catalog->ResidentStars += Count;
+    Catalog->InFlight++;
+
+    SDL_LockMutex(Catalog->Lock);
+    int Tail = (Catalog->RequestHead + Catalog->RequestCount) % STAR_LOAD_QUEUE_LENGTH;
+    Catalog->Requests[Tail] = Load;
+    Catalog->RequestCount++;
+    SDL_CondBroadcast(Catalog->QueueChanged);
+    SDL_UnlockMutex(Catalog->Lock);
+}
+
+/* Stars are sorted by magnitude, so loading fainter stars only appends.
+ * Buffers grow geometrically, so a tile loaded in many chunks is only
+ * copied a logarithmic number of times. */
+static void
+StarTileAppend(star_tile *Tile, star_record *Stars, uint32_t Count)
+{
+    uint32_t Needed = Tile->LoadedCount + Count;
+
+    if (Needed > Tile->Capacity) {
+        uint32_t Capacity = glm::max(glm::max(2 * Tile->Capacity, Needed), (uint32_t) STAR_MIN_CAPACITY);
+
+        GLuint Buffer;
+        glGenBuffers(1, &Buffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, Buffer);
+        glBufferData(GL_COPY_WRITE_BUFFER, sizeof(star_record) * Capacity, 0, GL_STATIC_DRAW);
+        if (Tile->Buffer) {
+            glBindBuffer(GL_COPY_READ_BUFFER, Tile->Buffer);
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                    0, 0, sizeof(star_record) * Tile->LoadedCount);
+            glBindBuffer(GL_COPY_READ_BUFFER, 0);
+            glDeleteBuffers(1, &Tile->Buffer);
+        }
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+        Tile->Buffer = Buffer;
+        Tile->Capacity = Capacity;
+    }
+
+    glBindBuffer(GL_COPY_WRITE_BUFFER, Tile->Buffer);
+    glBufferSubData(GL_COPY_WRITE_BUFFER,
+            sizeof(star_record) * Tile->LoadedCount,
+            sizeof(star_record) * Count,
+            Stars);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    Tile->LoadedCount = Needed;
+}
+
+// Uploads whatever the loader has finished
+static void
+StarCatalogCollect(star_catalog *Catalog)
+{
+    for (;;) {
+        SDL_LockMutex(Catalog->Lock);
+        if (!Catalog->CompletedCount) {
+            SDL_UnlockMutex(Catalog->Lock);
+            break;
+        }
+        star_load Load = Catalog->Completed[Catalog->CompletedHead];
+        Catalog->CompletedHead = (Catalog->CompletedHead + 1) % STAR_LOAD_QUEUE_LENGTH;
+        Catalog->CompletedCount--;
+        SDL_UnlockMutex(Catalog->Lock);
+
+        star_tile *Tile = &Catalog->Tiles[Load.Tile];
+        if (Load.Failed) {
+            fprintf(stderr, "Failed to read star tile %d\n", Load.Tile);
+            Catalog->ResidentStars -= Load.Count;
+            Tile->Failed = true;
+        } else {
+            StarTileAppend(Tile, Load.Stars, Load.Count);
+        }
+
+        Tile->Loading = false;
+        Catalog->FreeChunks[Catalog->FreeChunkCount++] = Load.Stars;
+        Catalog->InFlight--;
+    }
+}
+
+/* Finds the tiles inside the view cone and queues loads of their stars
+ * down to MagnitudeLimit. Returns true while loads are in flight or
+ * waiting for a later frame. */
+bool
+StarCatalogUpdate(star_catalog *Catalog, camera *Camera, float MagnitudeLimit)
+{
+    StarCatalogCollect(Catalog);
+
+    Catalog->Frame++;
+    Catalog->VisibleCount = 0;
+
+    float ViewRadius = atanf(glm::length(Camera->HalfScreen));
+    for (uint32_t i = 0; i < Catalog->Header.TileCount; ++i) {
+        star_tile *Tile = &Catalog->Tiles[i];
+        float Angle = acosf(glm::clamp(glm::dot(Tile->Center, Camera->LookVector), -1.0f, 1.0f));
+        if (Angle <= ViewRadius + Tile->Radius) {
+            Tile->LastVisibleFrame = Catalog->Frame;
+            Catalog->VisibleTiles[Catalog->VisibleCount++] = i;
+        }
+    }
+
+    uint32_t Budget = STAR_LOAD_BUDGET;
+    bool Pending = Catalog->InFlight > 0;
+
+    for (int i = 0; i < Catalog->VisibleCount; ++i) {
+        int TileIndex = Catalog->VisibleTiles[i];
+        star_tile *Tile = &Catalog->Tiles[TileIndex];
+        uint32_t Wanted = StarTileWantedCount(&Catalog->Entries[TileIndex], MagnitudeLimit);
+
+        Tile->DrawCount = glm::min(Wanted, Tile->LoadedCount);
+
+        // One load per tile at a time keeps the appends in order
+        if (Wanted <= Tile->LoadedCount || Tile->Loading || Tile->Failed)
+            continue;
+
+        uint32_t Count = glm::min(Wanted - Tile->LoadedCount, (uint32_t) STAR_LOAD_CHUNK);
+        Count = glm::min(Count, Budget);
+        if (!Count || !Catalog->FreeChunkCount) {
+            Pending = true;
+            continue;
+        }
+
+        // When the visible tiles alone fill the budget, fainter stars
+        // are left out rather than growing without bound, and there is
+        // nothing left to wait for.
+        if (!StarCatalogMakeRoom(Catalog, Count)) {
+            Count = (uint32_t) glm::min<uint64_t>(
+                    Count,
+                    Catalog->MaxResidentStars - Catalog->ResidentStars);
+            if (!Count)
+                continue;
+        }
+
+        StarTileRequest(Catalog, TileIndex, Count);
+        Budget -= Count;
+        Pending = true;
+    }
+
+    return Pending;
+}
+
+void
+StarCatalogDraw(star_catalog *Catalog)
+{
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glEnableVertexAttribArray(2);
+
+    for (int i = 0; i < Catalog->VisibleCount; ++i) {
+        star_tile *Tile = &Catalog->Tiles[Catalog->VisibleTiles[i]];
+        if (!Tile->DrawCount)
+            continue;
+
+        glBindBuffer(GL_ARRAY_BUFFER, Tile->Buffer);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(star_record),
+                (void *) offsetof(star_record, Direction));
+        glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, sizeof(star_record),
+                (void *) offsetof(star_record, Magnitude));
+        glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(star_record),
+                (void *) offsetof(star_record, Color));
+        glDrawArrays(GL_POINTS, 0, Tile->DrawCount);
+    }
+
+    glDisableVertexAttribArray(0);
+    glDisableVertexAttribArray(1);
+    glDisableVertexAttribArray(2);
+}
+
+void
+StarCatalogClose(star_catalog *Catalog)
+{
+    if (Catalog->Loader) {
+        SDL_LockMutex(Catalog->Lock);
+        Catalog->Finished = true;
+        SDL_CondBroadcast(Catalog->QueueChanged);
+        SDL_UnlockMutex(Catalog->Lock);
+        SDL_WaitThread(Catalog->Loader, 0);
+        StarCatalogCollect(Catalog);
+    }
+
+    if (Catalog->Tiles)
+        for (uint32_t i = 0; i < Catalog->Header.TileCount; ++i)
+            if (Catalog->Tiles[i].Buffer)
+                glDeleteBuffers(1, &Catalog->Tiles[i].Buffer);
+
+    for (int i = 0; i < Catalog->FreeChunkCount; ++i)
+        free(Catalog->FreeChunks[i]);
+
+    if (Catalog->Lock)
+        SDL_DestroyMutex(Catalog->Lock);
+    if (Catalog->QueueChanged)
+        SDL_DestroyCond(Catalog->QueueChanged);
+
+    free(Catalog->Entries);
+    free(Catalog->Tiles);
+    free(Catalog->VisibleTiles);
+    if (Catalog->File)
+        fclose(Catalog->File);
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "camera.h"
+#include "starfile.h"
+#include <GL/glew.h>
+#include <SDL2/SDL_mutex.h>
+#include <SDL2/SDL_thread.h>
+#include <glm/vec3.hpp>
+#include <stdint.h>
+#include <stdio.h>
+
+// Reads handed to the loader thread but not yet uploaded, each of at
+// most STAR_LOAD_CHUNK stars.
+#define STAR_LOAD_QUEUE_LENGTH 8
+#define STAR_LOAD_CHUNK (1 << 16)
+
+struct star_tile {
+    glm::vec3 Center;
+    float Radius;
+    GLuint Buffer;
+    uint32_t Capacity;
+    uint32_t LoadedCount;
+    uint32_t DrawCount;
+    int LastVisibleFrame;
+    bool Loading;
+    bool Failed;
+};
+
+struct star_load {
+    int Tile;
+    uint64_t FirstStar;
+    uint32_t Count;
+    bool Failed;
+    star_record *Stars;
+};
+
+struct star_catalog {
+    FILE *File;
+    star_file_header Header;
+    star_tile_entry *Entries;
+    star_tile *Tiles;
+    int *VisibleTiles;
+    int VisibleCount;
+    uint64_t ResidentStars;
+    uint64_t MaxResidentStars;
+    int Frame;
+
+    // Chunks not in flight, only touched by the render thread
+    star_record *FreeChunks[STAR_LOAD_QUEUE_LENGTH];
+    int FreeChunkCount;
+    int InFlight;
+
+    SDL_Thread *Loader;
+    SDL_mutex *Lock;
+    SDL_cond *QueueChanged;
+    star_load Requests[STAR_LOAD_QUEUE_LENGTH];
+    int RequestHead;
+    int RequestCount;
+    star_load Completed[STAR_LOAD_QUEUE_LENGTH];
+    int CompletedHead;
+    int CompletedCount;
+    bool Finished;
+};
+
+bool StarCatalogOpen(star_catalog *Catalog, const char *Path, uint64_t MaxResidentStars);
+bool StarCatalogUpdate(star_catalog *Catalog, camera *Camera, float MagnitudeLimit);
+void StarCatalogDraw(star_catalog *Catalog);
+void StarCatalogClose(star_catalog *Catalog);
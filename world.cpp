@@ -0,0 +1,390 @@
+#include "world.h"
+#include "maths.h"
+#include <glm/glm.hpp>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// km^3 / (kg s^2)
+#define G 6.674e-20
+
+// Rectify once the perturbations have moved a moon this far, relative
+// to its distance from the parent, off the osculating orbit.
+#define MAX_DEVIATION 0.01
+
+#define KEPLER_ITERATIONS 20
+
+#define TAU 6.283185307179586
+
+// Substeps per orbit of the fastest moon
+#define MOON_STEPS_PER_ORBIT 128
+
+static void
+Stumpff(double Z, double *C, double *S)
+{
+    if (Z > 1e-6) {
+        double SqrtZ = sqrt(Z);
+        *C = (1.0 - cos(SqrtZ)) / Z;
+        *S = (SqrtZ - sin(SqrtZ)) / (Z * SqrtZ);
+    } else if (Z < -1e-6) {
+        double SqrtZ = sqrt(-Z);
+        *C = (cosh(SqrtZ) - 1.0) / -Z;
+        *S = (sinh(SqrtZ) - SqrtZ) / (-Z * SqrtZ);
+    } else {
+        *C = 1.0 / 2.0 - Z / 24.0;
+        *S = 1.0 / 6.0 - Z / 120.0;
+    }
+}
+
+/* Two body propagation with universal variables, so it works for any
+ * kind of orbit. */
+static void
+KeplerPropagate(
+        glm::dvec3 Position0,
+        glm::dvec3 Velocity0,
+        double Mu,
+        double Time,
+        glm::dvec3 *Position,
+        glm::dvec3 *Velocity)
+{
+    double SqrtMu = sqrt(Mu);
+    double R0 = glm::length(Position0);
+    double RadialVelocity0 = glm::dot(Position0, Velocity0) / R0;
+    double Alpha = 2.0 / R0 - glm::dot(Velocity0, Velocity0) / Mu;
+
+    double Chi = SqrtMu * fabs(Alpha) * Time;
+    double C, S;
+    for (int i = 0; i < KEPLER_ITERATIONS; ++i) {
+        double Z = Alpha * Chi * Chi;
+        Stumpff(Z, &C, &S);
+        double F = R0 * RadialVelocity0 / SqrtMu * Chi * Chi * C
+            + (1.0 - Alpha * R0) * Chi * Chi * Chi * S
+            + R0 * Chi
+            - SqrtMu * Time;
+        double dF = R0 * RadialVelocity0 / SqrtMu * Chi * (1.0 - Z * S)
+            + (1.0 - Alpha * R0) * Chi * Chi * C
+            + R0;
+        double Step = F / dF;
+        Chi -= Step;
+        if (fabs(Step) < 1e-9 * (fabs(Chi) + 1e-9))
+            break;
+    }
+    Stumpff(Alpha * Chi * Chi, &C, &S);
+
+    double Lagrangef = 1.0 - Chi * Chi / R0 * C;
+    double Lagrangeg = Time - Chi * Chi * Chi / SqrtMu * S;
+    *Position = Lagrangef * Position0 + Lagrangeg * Velocity0;
+
+    double R = glm::length(*Position);
+    double dLagrangef = SqrtMu / (R * R0) * (Alpha * Chi * Chi * Chi * S - Chi);
+    double dLagrangeg = 1.0 - Chi * Chi / R * C;
+    *Velocity = dLagrangef * Position0 + dLagrangeg * Velocity0;
+}
+
+void
+WorldRectify(world *World, int Body)
+{
+    World->OsculatingPosition[Body] = World->Position[Body];
+    World->OsculatingVelocity[Body] = World->Velocity[Body];
+    World->OsculatingTime[Body] = 0.0;
+    World->DeviationPosition[Body] = glm::vec3(0.0f);
+    World->DeviationVelocity[Body] = glm::vec3(0.0f);
+}
+
+void
+WorldAbsolutePositions(world *World, glm::vec3 *Positions)
+{
+    for (int i = 0; i < World->Count; ++i) {
+        Positions[i] = World->Position[i];
+        if (World->Parent[i] != NO_PARENT)
+            Positions[i] += Positions[World->Parent[i]];
+    }
+}
+
+struct reorder_key {
+    unsigned int RootCode;
+    int Root;
+    int Depth;
+    unsigned int Code;
+    int Index;
+};
+
+static int
+CompareReorderKeys(const void *A, const void *B)
+{
+    const reorder_key *KeyA = (const reorder_key *) A;
+    const reorder_key *KeyB = (const reorder_key *) B;
+
+    if (KeyA->RootCode != KeyB->RootCode)
+        return KeyA->RootCode < KeyB->RootCode ? -1 : 1;
+    if (KeyA->Root != KeyB->Root)
+        return KeyA->Root - KeyB->Root;
+    if (KeyA->Depth != KeyB->Depth)
+        return KeyA->Depth - KeyB->Depth;
+    if (KeyA->Code != KeyB->Code)
+        return KeyA->Code < KeyB->Code ? -1 : 1;
+    return KeyA->Index - KeyB->Index;
+}
+
+template <typename T>
+static void
+PermuteColumn(T *Column, const int *Order, int Count)
+{
+    T Permuted[MAX_BODY];
+    for (int i = 0; i < Count; ++i)
+        memcpy(&Permuted[i], &Column[Order[i]], sizeof(T));
+    memcpy(Column, Permuted, sizeof(T) * Count);
+}
+
+/* Sorts the bodies along a Morton curve, so that bodies close in space
+ * are close in memory. Systems are kept together by sorting on their top
+ * level body first, and moons by depth after that so that parents still
+ * come before their children. */
+void
+WorldReorder(world *World)
+{
+    if (!World->Count)
+        return;
+
+    glm::vec3 Absolute[MAX_BODY];
+    WorldAbsolutePositions(World, Absolute);
+
+    glm::vec3 Min = Absolute[0];
+    glm::vec3 Max = Absolute[0];
+    for (int i = 1; i < World->Count; ++i) {
+        Min = glm::min(Min, Absolute[i]);
+        Max = glm::max(Max, Absolute[i]);
+    }
+    glm::vec3 Scale = 1.0f / glm::max(Max - Min, glm::vec3(1e-6f));
+
+    reorder_key Keys[MAX_BODY];
+    for (int i = 0; i < World->Count; ++i) {
+        reorder_key *Key = &Keys[i];
+        Key->Code = MortonCode((Absolute[i] - Min) * Scale);
+        Key->Index = i;
+        if (World->Parent[i] == NO_PARENT) {
+            Key->Root = i;
+            Key->Depth = 0;
+            Key->RootCode = Key->Code;
+        } else {
+            reorder_key *ParentKey = &Keys[World->Parent[i]];
+            Key->Root = ParentKey->Root;
+            Key->Depth = ParentKey->Depth + 1;
+            Key->RootCode = ParentKey->RootCode;
+        }
+    }
+    qsort(Keys, World->Count, sizeof(reorder_key), CompareReorderKeys);
+
+    int Order[MAX_BODY];
+    int NewIndex[MAX_BODY];
+    for (int i = 0; i < World->Count; ++i) {
+        Order[i] = Keys[i].Index;
+        NewIndex[Keys[i].Index] = i;
+    }
+
+    PermuteColumn(World->Id, Order, World->Count);
+    PermuteColumn(World->Name, Order, World->Count);
+    PermuteColumn(World->Parent, Order, World->Count);
+    PermuteColumn(World->Radius, Order, World->Count);
+    PermuteColumn(World->Mass, Order, World->Count);
+    PermuteColumn(World->Position, Order, World->Count);
+    PermuteColumn(World->Velocity, Order, World->Count);
+    PermuteColumn(World->Color, Order, World->Count);
+    PermuteColumn(World->OsculatingPosition, Order, World->Count);
+    PermuteColumn(World->OsculatingVelocity, Order, World->Count);
+    PermuteColumn(World->OsculatingTime, Order, World->Count);
+    PermuteColumn(World->DeviationPosition, Order, World->Count);
+    PermuteColumn(World->DeviationVelocity, Order, World->Count);
+
+    for (int i = 0; i < World->Count; ++i) {
+        if (World->Parent[i] != NO_PARENT)
+            World->Parent[i] = NewIndex[World->Parent[i]];
+        World->IndexOfId[World->Id[i]] = i;
+    }
+}
+
+/* Position of Body relative to Origin, without going through barycentric
+ * coordinates for the common case of siblings. */
+static glm::dvec3
+RelativePosition(world *World, glm::dvec3 *Absolute, int Body, int Origin)
+{
+    if (Body == Origin)
+        return glm::dvec3(0.0);
+    if (World->Parent[Body] == Origin)
+        return glm::dvec3(World->Position[Body]);
+    if (World->Parent[Body] != NO_PARENT && World->Parent[Body] == World->Parent[Origin])
+        return glm::dvec3(World->Position[Body]) - glm::dvec3(World->Position[Origin]);
+    return Absolute[Body] - Absolute[Origin];
+}
+
+static glm::dvec3
+Gravity(glm::dvec3 Delta, double Mu)
+{
+    double Distance = glm::length(Delta);
+    return Mu / (Distance * Distance * Distance) * Delta;
+}
+
+/* Top level bodies are pulled by the other top level bodies as point
+ * masses including their moons. Moons only get the perturbation: the
+ * pull of everything else on them minus its pull on their parent. */
+static void
+WorldAccelerations(world *World, glm::dvec3 *Acceleration)
+{
+    double SystemMass[MAX_BODY];
+    glm::dvec3 Absolute[MAX_BODY];
+
+    for (int i = 0; i < World->Count; ++i) {
+        SystemMass[i] = World->Mass[i];
+        Absolute[i] = glm::dvec3(World->Position[i]);
+        if (World->Parent[i] != NO_PARENT)
+            Absolute[i] += Absolute[World->Parent[i]];
+    }
+    for (int i = World->Count - 1; i >= 0; --i)
+        if (World->Parent[i] != NO_PARENT)
+            SystemMass[World->Parent[i]] += SystemMass[i];
+
+    for (int i = 0; i < World->Count; ++i) {
+        int Parent = World->Parent[i];
+        Acceleration[i] = glm::dvec3(0.0);
+
+        if (Parent == NO_PARENT) {
+            for (int j = 0; j < World->Count; ++j)
+                if (j != i && World->Parent[j] == NO_PARENT)
+                    Acceleration[i] += Gravity(Absolute[j] - Absolute[i], G * SystemMass[j]);
+            continue;
+        }
+
+        glm::dvec3 Relative = RelativePosition(World, Absolute, i, Parent);
+        for (int j = 0; j < World->Count; ++j) {
+            if (j == i || j == Parent)
+                continue;
+            glm::dvec3 FromParent = RelativePosition(World, Absolute, j, Parent);
+            Acceleration[i] += Gravity(FromParent - Relative, G * World->Mass[j]);
+            Acceleration[i] -= Gravity(FromParent, G * World->Mass[j]);
+        }
+    }
+}
+
+static double
+OrbitMu(world *World, int Body)
+{
+    return G * (World->Mass[World->Parent[Body]] + World->Mass[Body]);
+}
+
+static void
+OsculatingState(world *World, int Body, glm::dvec3 *Position, glm::dvec3 *Velocity)
+{
+    KeplerPropagate(
+            glm::dvec3(World->OsculatingPosition[Body]),
+            glm::dvec3(World->OsculatingVelocity[Body]),
+            OrbitMu(World, Body),
+            World->OsculatingTime[Body],
+            Position,
+            Velocity);
+}
+
+/* The true orbit differs from the osculating one by the deviation, and
+ * so does the central pull. Everything here must be taken at the same
+ * time as the perturbation. */
+static glm::dvec3
+DeviationAcceleration(world *World, int Body, glm::dvec3 Perturbation, glm::dvec3 Osculating)
+{
+    double Mu = OrbitMu(World, Body);
+    glm::dvec3 Position = Osculating + glm::dvec3(World->DeviationPosition[Body]);
+    return Perturbation + Gravity(-Position, Mu) - Gravity(-Osculating, Mu);
+}
+
+/* Kick-drift-kick leapfrog. Top level bodies are integrated directly.
+ * Moons follow the two body orbit around their parent analytically, and
+ * only the deviation caused by all other bodies is integrated (Encke's
+ * method). Every kick sees the whole world at a single instant. */
+static void
+WorldLeapfrog(world *World, double Seconds)
+{
+    double Half = 0.5 * Seconds;
+    glm::dvec3 Acceleration[MAX_BODY];
+    glm::dvec3 Osculating[MAX_BODY];
+    glm::dvec3 OsculatingVelocity[MAX_BODY];
+
+    WorldAccelerations(World, Acceleration);
+    for (int i = 0; i < World->Count; ++i) {
+        if (World->Parent[i] == NO_PARENT) {
+            World->Velocity[i] += glm::vec3(Acceleration[i] * Half);
+            continue;
+        }
+        OsculatingState(World, i, &Osculating[i], &OsculatingVelocity[i]);
+        glm::dvec3 DeviationVelocity(World->DeviationVelocity[i]);
+        DeviationVelocity += DeviationAcceleration(World, i, Acceleration[i], Osculating[i]) * Half;
+        World->DeviationVelocity[i] = glm::vec3(DeviationVelocity);
+    }
+
+    for (int i = 0; i < World->Count; ++i) {
+        if (World->Parent[i] == NO_PARENT) {
+            World->Position[i] += World->Velocity[i] * (float) Seconds;
+            continue;
+        }
+        World->OsculatingTime[i] += Seconds;
+        OsculatingState(World, i, &Osculating[i], &OsculatingVelocity[i]);
+        glm::dvec3 DeviationPosition(World->DeviationPosition[i]);
+        DeviationPosition += glm::dvec3(World->DeviationVelocity[i]) * Seconds;
+        World->DeviationPosition[i] = glm::vec3(DeviationPosition);
+        World->Position[i] = glm::vec3(Osculating[i] + DeviationPosition);
+    }
+
+    WorldAccelerations(World, Acceleration);
+    for (int i = 0; i < World->Count; ++i) {
+        if (World->Parent[i] == NO_PARENT) {
+            World->Velocity[i] += glm::vec3(Acceleration[i] * Half);
+            continue;
+        }
+        glm::dvec3 DeviationVelocity(World->DeviationVelocity[i]);
+        DeviationVelocity += DeviationAcceleration(World, i, Acceleration[i], Osculating[i]) * Half;
+        World->DeviationVelocity[i] = glm::vec3(DeviationVelocity);
+        World->Velocity[i] = glm::vec3(OsculatingVelocity[i] + DeviationVelocity);
+
+        glm::dvec3 DeviationPosition(World->DeviationPosition[i]);
+        if (glm::length(DeviationPosition) > MAX_DEVIATION * glm::length(Osculating[i]))
+            WorldRectify(World, i);
+    }
+}
+
+/* Splits the step so that no moon moves more than a small part of its
+ * orbit per substep. The deviation is small and slow, but the
+ * perturbations driving it change as fast as the moons move. */
+void
+WorldStep(world *World, float Seconds)
+{
+    double Substep = Seconds;
+    for (int i = 0; i < World->Count; ++i) {
+        if (World->Parent[i] == NO_PARENT)
+            continue;
+        double Distance = glm::length(glm::dvec3(World->Position[i]));
+        double Period = TAU * sqrt(Distance * Distance * Distance / OrbitMu(World, i));
+        Substep = glm::min(Substep, Period / MOON_STEPS_PER_ORBIT);
+    }
+
+    int Substeps = (int) ceil(Seconds / Substep);
+    for (int Step = 0; Step < Substeps; ++Step)
+        WorldLeapfrog(World, (double) Seconds / Substeps);
+}
+
+int
+WorldFirstChild(world *World, int Body)
+{
+    for (int i = Body + 1; i < World->Count; ++i)
+        if (World->Parent[i] == Body)
+            return i;
+    return Body;
+}
+
+int
+WorldNextSibling(world *World, int Body)
+{
+    int Parent = World->Parent[Body];
+    for (int Step = 1; Step < World->Count; ++Step) {
+        int i = (Body + Step) % World->Count;
+        if (World->Parent[i] == Parent)
+            return i;
+    }
+    return Body;
+}
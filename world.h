@@ -2,15 +2,48 @@
 
 #include <glm/vec3.hpp>
 
+#ifndef MAX_BODY
 #define MAX_BODY 100
+#endif
 #define MAX_NAME 20
+#define NO_PARENT -1
 
+// Seconds of simulated time per WorldStep in the viewer
+#define SIMULATION_STEP 3600.0f
+
+// Moons have a parent, which always comes before them, and their
+// position and velocity are relative to it. Other bodies are
+// barycentric.
+//
+// Indices change when WorldReorder sorts the bodies, so anything kept
+// across frames should hold the body's Id. That is its position among
+// the rows ReadWorldFile accepted, so comments and skipped lines don't
+// count.
 struct world {
 	int Count;
+	int Id[MAX_BODY];
+	int IndexOfId[MAX_BODY];
 	char Name[MAX_BODY][MAX_NAME];
+	int Parent[MAX_BODY];
 	float Radius[MAX_BODY];
 	float Mass[MAX_BODY];
 	glm::vec3 Position[MAX_BODY];
 	glm::vec3 Velocity[MAX_BODY];
 	glm::vec3 Color[MAX_BODY];
+
+	// Encke state of moons: the two body orbit around the parent that
+	// osculated at the last rectification, the time since then, and how
+	// far the perturbations have moved the moon off it.
+	glm::vec3 OsculatingPosition[MAX_BODY];
+	glm::vec3 OsculatingVelocity[MAX_BODY];
+	double OsculatingTime[MAX_BODY];
+	glm::vec3 DeviationPosition[MAX_BODY];
+	glm::vec3 DeviationVelocity[MAX_BODY];
 };
+
+void WorldRectify(world *World, int Body);
+void WorldStep(world *World, float Seconds);
+void WorldReorder(world *World);
+void WorldAbsolutePositions(world *World, glm::vec3 *Positions);
+int WorldFirstChild(world *World, int Body);
+int WorldNextSibling(world *World, int Body);
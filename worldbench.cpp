@@ -0,0 +1,316 @@
+/* Times WorldStep and WorldAbsolutePositions on a large synthetic world,
+ * once in the order the bodies were created and once after
+ * WorldReorder. On Linux it also counts cache misses with the
+ * performance counters, like perf stat -e cache-misses,L1-dcache-load-misses.
+ *
+ * Top level bodies are scattered through a sphere the size of the outer
+ * solar system, each with a few moons on circular orbits. Bodies are
+ * created in random order, with every parent still before its moons,
+ * which is about as far from spatial order as a world file gets.
+ *
+ * Build with a larger MAX_BODY than the viewer uses, see the Makefile. */
+
+#include "world.h"
+#include <glm/glm.hpp>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define DEFAULT_ROOTS 1000
+#define DEFAULT_MOONS 3
+#define DEFAULT_STEPS 10
+// WorldAbsolutePositions is much cheaper, so it runs this many times more
+#define ABSOLUTE_REPEAT 1000
+#define STEP_SECONDS 3600.0f
+
+// km^3 / (kg s^2)
+#define G 6.674e-20
+#define WORLD_SIZE 1e10f
+
+static float
+RandomFloat(float Min, float Max)
+{
+    return Min + (Max - Min) * ((float) rand() / (float) RAND_MAX);
+}
+
+static glm::vec3
+RandomDirection()
+{
+    glm::vec3 Direction;
+    do {
+        Direction = glm::vec3(RandomFloat(-1.0f, 1.0f), RandomFloat(-1.0f, 1.0f), RandomFloat(-1.0f, 1.0f));
+    } while (glm::dot(Direction, Direction) > 1.0f || glm::dot(Direction, Direction) < 1e-3f);
+    return glm::normalize(Direction);
+}
+
+static void
+Shuffle(int *Values, int Count)
+{
+    for (int i = Count - 1; i > 0; --i) {
+        int j = rand() % (i + 1);
+        int Value = Values[i];
+        Values[i] = Values[j];
+        Values[j] = Value;
+    }
+}
+
+static void
+AddBody(world *World, int Parent, float Radius, float Mass, glm::vec3 Position, glm::vec3 Velocity)
+{
+    int i = World->Count++;
+    snprintf(World->Name[i], MAX_NAME, "Body %d", i);
+    World->Id[i] = i;
+    World->IndexOfId[i] = i;
+    World->Parent[i] = Parent;
+    World->Radius[i] = Radius;
+    World->Mass[i] = Mass;
+    World->Position[i] = Position;
+    World->Velocity[i] = Velocity;
+    World->Color[i] = glm::vec3(1.0f);
+    WorldRectify(World, i);
+}
+
+static void
+MakeWorld(world *World, int RootCount, int MoonsPerRoot)
+{
+    World->Count = 0;
+
+    int *Order = (int *) malloc(sizeof(int) * RootCount * (MoonsPerRoot + 1));
+    for (int i = 0; i < RootCount; ++i)
+        Order[i] = i;
+    Shuffle(Order, RootCount);
+
+    // Created order to index, so that moons can find their parent
+    int *RootIndex = (int *) malloc(sizeof(int) * RootCount);
+    for (int i = 0; i < RootCount; ++i) {
+        RootIndex[Order[i]] = World->Count;
+        glm::vec3 Position = RandomDirection() * RandomFloat(0.0f, WORLD_SIZE);
+        glm::vec3 Velocity = RandomDirection() * RandomFloat(0.0f, 10.0f);
+        AddBody(World, NO_PARENT, 60000.0f, 1e27f, Position, Velocity);
+    }
+
+    int MoonCount = RootCount * MoonsPerRoot;
+    for (int i = 0; i < MoonCount; ++i)
+        Order[i] = i;
+    Shuffle(Order, MoonCount);
+
+    for (int i = 0; i < MoonCount; ++i) {
+        int Parent = RootIndex[Order[i] / MoonsPerRoot];
+        glm::vec3 Direction = RandomDirection();
+        glm::vec3 Axis = glm::normalize(glm::cross(Direction, RandomDirection()));
+        float Distance = RandomFloat(1e6f, 1e7f);
+        float Speed = (float) sqrt(G * World->Mass[Parent] / Distance);
+        AddBody(World, Parent, 2000.0f, 1e23f,
+                Direction * Distance,
+                glm::cross(Axis, Direction) * Speed);
+    }
+
+    free(RootIndex);
+    free(Order);
+}
+
+static double
+Seconds(clock_t Start, clock_t End)
+{
+    return (double) (End - Start) / CLOCKS_PER_SEC;
+}
+
+enum counter {
+    COUNTER_CACHE_MISSES,
+    COUNTER_L1D_MISSES,
+    COUNTER_COUNT,
+};
+
+struct measurement {
+    double Seconds;
+    unsigned long long Counts[COUNTER_COUNT];
+};
+
+// File descriptors of the counters, -1 where they aren't available
+static int Counters[COUNTER_COUNT];
+
+static void
+CountersOpen()
+{
+    for (int i = 0; i < COUNTER_COUNT; ++i)
+        Counters[i] = -1;
+
+#ifdef __linux__
+    perf_event_attr Attr;
+    memset(&Attr, 0, sizeof(Attr));
+    Attr.size = sizeof(Attr);
+    Attr.disabled = 1;
+    Attr.exclude_kernel = 1;
+    Attr.exclude_hv = 1;
+
+    Attr.type = PERF_TYPE_HARDWARE;
+    Attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    Counters[COUNTER_CACHE_MISSES] = (int) syscall(SYS_perf_event_open, &Attr, 0, -1, -1, 0);
+
+    Attr.type = PERF_TYPE_HW_CACHE;
+    Attr.config = PERF_COUNT_HW_CACHE_L1D
+        | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+        | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    Counters[COUNTER_L1D_MISSES] = (int) syscall(SYS_perf_event_open, &Attr, 0, -1, -1, 0);
+#endif
+
+    if (Counters[COUNTER_CACHE_MISSES] < 0 || Counters[COUNTER_L1D_MISSES] < 0)
+        printf("Cache miss counters aren't available, only timing\n");
+}
+
+static void
+CountersStart()
+{
+#ifdef __linux__
+    for (int i = 0; i < COUNTER_COUNT; ++i) {
+        if (Counters[i] < 0)
+            continue;
+        ioctl(Counters[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(Counters[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+static void
+CountersStop(measurement *Measurement)
+{
+    for (int i = 0; i < COUNTER_COUNT; ++i) {
+        Measurement->Counts[i] = 0;
+#ifdef __linux__
+        if (Counters[i] < 0)
+            continue;
+        ioctl(Counters[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(Counters[i], &Measurement->Counts[i], sizeof(Measurement->Counts[i]))
+                != sizeof(Measurement->Counts[i]))
+            Measurement->Counts[i] = 0;
+#endif
+    }
+}
+
+static measurement
+MeasureSteps(world *World, int Steps)
+{
+    measurement Measurement;
+    clock_t Start = clock();
+    CountersStart();
+    for (int i = 0; i < Steps; ++i)
+        WorldStep(World, STEP_SECONDS);
+    CountersStop(&Measurement);
+    Measurement.Seconds = Seconds(Start, clock());
+    return Measurement;
+}
+
+// Every moon reads its parent, which is what the viewer does each frame
+static measurement
+MeasureAbsolute(world *World, int Repeat)
+{
+    static glm::vec3 Absolute[MAX_BODY];
+    measurement Measurement;
+    clock_t Start = clock();
+    CountersStart();
+    for (int i = 0; i < Repeat; ++i)
+        WorldAbsolutePositions(World, Absolute);
+    CountersStop(&Measurement);
+    Measurement.Seconds = Seconds(Start, clock());
+    return Measurement;
+}
+
+static void
+PrintMeasurement(const char *Name, measurement *Measurement, int Repeat)
+{
+    printf("%-32s %10.4f ms %12.0f %12.0f\n",
+            Name,
+            1000.0 * Measurement->Seconds / Repeat,
+            (double) Measurement->Counts[COUNTER_CACHE_MISSES] / Repeat,
+            (double) Measurement->Counts[COUNTER_L1D_MISSES] / Repeat);
+}
+
+static void
+PrintUsage(const char *Program)
+{
+    fprintf(stderr,
+            "Usage: %s [-roots N] [-moons N] [-steps N]\n"
+            "  -roots N   Top level bodies (default %d)\n"
+            "  -moons N   Moons of each top level body (default %d)\n"
+            "  -steps N   Steps timed in each order (default %d)\n"
+            "             WorldAbsolutePositions runs %d times as often\n",
+            Program,
+            DEFAULT_ROOTS,
+            DEFAULT_MOONS,
+            DEFAULT_STEPS,
+            ABSOLUTE_REPEAT);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int RootCount = DEFAULT_ROOTS;
+    int MoonsPerRoot = DEFAULT_MOONS;
+    int Steps = DEFAULT_STEPS;
+
+    for (int i = 1; i < argc; ++i) {
+        bool HasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "-roots") && HasValue) {
+            RootCount = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-moons") && HasValue) {
+            MoonsPerRoot = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-steps") && HasValue) {
+            Steps = atoi(argv[++i]);
+        } else {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (RootCount <= 0 || MoonsPerRoot < 0 || Steps <= 0) {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+    if (RootCount * (MoonsPerRoot + 1) > MAX_BODY) {
+        fprintf(stderr, "At most %d bodies, rebuild with a larger MAX_BODY\n", MAX_BODY);
+        return 1;
+    }
+
+    world *World = (world *) malloc(sizeof(world));
+    world *Reordered = (world *) malloc(sizeof(world));
+    srand(1);
+    MakeWorld(World, RootCount, MoonsPerRoot);
+    memcpy(Reordered, World, sizeof(world));
+
+    printf("%d bodies, %d steps\n", World->Count, Steps);
+    CountersOpen();
+
+    clock_t Start = clock();
+    WorldReorder(Reordered);
+    printf("WorldReorder: %.3f ms\n", 1000.0 * Seconds(Start, clock()));
+
+    // Once untimed each, so both start with warm caches
+    WorldStep(World, STEP_SECONDS);
+    WorldStep(Reordered, STEP_SECONDS);
+
+    int Repeat = Steps * ABSOLUTE_REPEAT;
+    measurement CreatedStep = MeasureSteps(World, Steps);
+    measurement SortedStep = MeasureSteps(Reordered, Steps);
+    measurement CreatedAbsolute = MeasureAbsolute(World, Repeat);
+    measurement SortedAbsolute = MeasureAbsolute(Reordered, Repeat);
+
+    printf("\n%-32s %13s %12s %12s\n", "Per call", "time", "cache miss", "L1d miss");
+    PrintMeasurement("WorldStep, created", &CreatedStep, Steps);
+    PrintMeasurement("WorldStep, Morton", &SortedStep, Steps);
+    PrintMeasurement("WorldAbsolutePositions, created", &CreatedAbsolute, Repeat);
+    PrintMeasurement("WorldAbsolutePositions, Morton", &SortedAbsolute, Repeat);
+
+    free(World);
+    free(Reordered);
+
+    return 0;
+}